@@ -0,0 +1,233 @@
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 64
+#define ARENA_MIN_CLASS 6           // наименьший кусок arena_malloc — 64 байта
+#define ARENA_CHUNK_HEADER 16       // класс куска перед данными; выравнивание как у malloc
+
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    unsigned char* data;
+};
+
+void arena_init(struct Arena* arena, size_t block_size) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size;
+    arena->large = NULL;
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+}
+
+static struct ArenaBlock* arena_new_block(size_t size) {
+    struct ArenaBlock* block = (struct ArenaBlock*)malloc(sizeof(struct ArenaBlock) + size + ARENA_ALIGN);
+    if (block) {
+        block->next = NULL;
+        block->size = size + ARENA_ALIGN;
+        block->used = 0;
+        block->data = (unsigned char*)(block + 1);
+    }
+    return block;
+}
+
+static void* arena_take(struct ArenaBlock* block, size_t size, size_t align) {
+    void* result = NULL;
+    uintptr_t base = (uintptr_t)block->data;
+    uintptr_t start = (base + block->used + align - 1) & ~(uintptr_t)(align - 1);
+
+    if (start + size <= base + block->size) {
+        block->used = start + size - base;
+        result = (void*)start;
+    }
+    return result;
+}
+
+void* arena_alloc_aligned(struct Arena* arena, size_t size, size_t align) {
+    void* result = NULL;
+
+    if (align < ARENA_ALIGN) align = ARENA_ALIGN;
+    if (size == 0) size = 1;
+
+    if (arena->current) {
+        result = arena_take(arena->current, size, align);
+    }
+
+    // Блоки, оставшиеся после arena_reset, используются повторно по порядку
+    while (!result && arena->current && arena->current->next) {
+        arena->current = arena->current->next;
+        arena->current->used = 0;
+        result = arena_take(arena->current, size, align);
+    }
+
+    if (!result) {
+        size_t block_size = size + align > arena->block_size ? size + align : arena->block_size;
+        struct ArenaBlock* block = arena_new_block(block_size);
+        if (block) {
+            if (arena->current) {
+                arena->current->next = block;
+            } else {
+                arena->first = block;
+            }
+            arena->current = block;
+            result = arena_take(block, size, align);
+        }
+    }
+
+    return result;
+}
+
+void* arena_alloc(struct Arena* arena, size_t size) {
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+void* arena_calloc(struct Arena* arena, size_t count, size_t size) {
+    void* result = NULL;
+
+    if (size == 0 || count <= SIZE_MAX / size) {
+        result = arena_alloc(arena, count * size);
+        if (result) memset(result, 0, count * size);
+    }
+    return result;
+}
+
+// Кусок больше половины блока живёт отдельно: растёт через realloc и сразу отдаётся системе
+struct ArenaLarge {
+    struct ArenaLarge* prev;
+    struct ArenaLarge* next;
+    size_t size;
+    size_t cls;                 // ARENA_LARGE; у мелких кусков на этом месте класс
+};
+
+#define ARENA_LARGE ((size_t)-1)
+
+static size_t arena_chunk_class(const void* ptr) {
+    return ((const size_t*)ptr)[-1];
+}
+
+static void arena_link_large(struct Arena* arena, struct ArenaLarge* large) {
+    large->prev = NULL;
+    large->next = arena->large;
+    if (large->next) large->next->prev = large;
+    arena->large = large;
+}
+
+static void arena_unlink_large(struct Arena* arena, struct ArenaLarge* large) {
+    if (large->prev) large->prev->next = large->next;
+    else arena->large = large->next;
+    if (large->next) large->next->prev = large->prev;
+}
+
+// Кусок, который можно вернуть через arena_free: размер округляется до степени двойки,
+// освобождённые куски ждут в списке своего класса и выдаются снова без обращения к malloc
+void* arena_malloc(struct Arena* arena, size_t size) {
+    void* result = NULL;
+    unsigned cls = ARENA_MIN_CLASS;
+
+    while (cls < ARENA_CLASSES && ((size_t)1 << cls) < size) cls++;
+
+    if (size > arena->block_size / 2) {
+        struct ArenaLarge* large = size <= SIZE_MAX - sizeof(*large) ?
+                                   (struct ArenaLarge*)malloc(sizeof(*large) + size) : NULL;
+        if (large) {
+            large->size = size;
+            large->cls = ARENA_LARGE;
+            arena_link_large(arena, large);
+            result = large + 1;
+        }
+    } else if (arena->free_lists[cls]) {
+        result = arena->free_lists[cls];
+        arena->free_lists[cls] = *(void**)result;
+    } else {
+        unsigned char* chunk = (unsigned char*)arena_alloc(arena, ARENA_CHUNK_HEADER + ((size_t)1 << cls));
+        if (chunk) {
+            result = chunk + ARENA_CHUNK_HEADER;
+            ((size_t*)result)[-1] = cls;
+        }
+    }
+    return result;
+}
+
+void arena_free(struct Arena* arena, void* ptr) {
+    if (ptr && arena_chunk_class(ptr) == ARENA_LARGE) {
+        struct ArenaLarge* large = (struct ArenaLarge*)ptr - 1;
+        arena_unlink_large(arena, large);
+        free(large);
+    } else if (ptr) {
+        size_t cls = arena_chunk_class(ptr);
+        *(void**)ptr = arena->free_lists[cls];
+        arena->free_lists[cls] = ptr;
+    }
+}
+
+// Как realloc: при нехватке памяти возвращает NULL, а старый кусок остаётся целым
+void* arena_realloc(struct Arena* arena, void* ptr, size_t size) {
+    void* result = ptr;
+
+    if (!ptr) {
+        result = arena_malloc(arena, size);
+    } else if (arena_chunk_class(ptr) == ARENA_LARGE) {
+        struct ArenaLarge* large = (struct ArenaLarge*)ptr - 1;
+        if (size > large->size) {
+            // realloc может сдвинуть кусок: на время вызова он исключается из списка
+            struct ArenaLarge* grown;
+
+            arena_unlink_large(arena, large);
+            grown = size <= SIZE_MAX - sizeof(*large) ?
+                    (struct ArenaLarge*)realloc(large, sizeof(*large) + size) : NULL;
+            if (grown) {
+                grown->size = size;
+                large = grown;
+            }
+            arena_link_large(arena, large);
+            result = grown ? large + 1 : NULL;
+        }
+    } else if (size > ((size_t)1 << arena_chunk_class(ptr))) {
+        result = arena_malloc(arena, size);
+        if (result) {
+            memcpy(result, ptr, (size_t)1 << arena_chunk_class(ptr));
+            arena_free(arena, ptr);
+        }
+    }
+    return result;
+}
+
+static void arena_free_large(struct Arena* arena) {
+    while (arena->large) {
+        struct ArenaLarge* next = arena->large->next;
+        free(arena->large);
+        arena->large = next;
+    }
+}
+
+// Все выделения разом становятся недействительными; блоки остаются для следующих.
+// Отдельные крупные куски к этому моменту обычно уже освобождены их владельцами.
+void arena_reset(struct Arena* arena) {
+    arena_free_large(arena);
+    arena->current = arena->first;
+    if (arena->current) arena->current->used = 0;
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+}
+
+void arena_release(struct Arena* arena) {
+    arena_free_large(arena);
+    struct ArenaBlock* block = arena->first;
+    while (block) {
+        struct ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+}
+
+png_voidp png_arena_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    return arena_malloc((struct Arena*)png_get_mem_ptr(png_ptr), size);
+}
+
+void png_arena_free(png_structp png_ptr, png_voidp ptr) {
+    arena_free((struct Arena*)png_get_mem_ptr(png_ptr), ptr);
+}
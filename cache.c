@@ -0,0 +1,316 @@
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define CACHE_MAGIC "CWSC"
+#define CACHE_VERSION 1
+#define CACHE_HEADER_SIZE 24
+#define CACHE_ENTRY_SIZE 32
+#define STRIPE_ROWS 64
+
+struct Stripe {
+    uint64_t hash;
+    uint32_t adler;
+    uint64_t raw_len;
+    uint64_t comp_len;
+    const png_byte* data;
+};
+
+struct StripeCache {
+    struct InputMap map;
+    uint32_t count;
+    struct Stripe* stripes;
+};
+
+static void put_le32(png_bytep p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (png_byte)(v >> (8 * i));
+}
+
+static void put_le64(png_bytep p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (png_byte)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const png_byte* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+static uint64_t get_le64(const png_byte* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static void put_be32(png_bytep p, uint32_t v) {
+    p[0] = (png_byte)(v >> 24);
+    p[1] = (png_byte)(v >> 16);
+    p[2] = (png_byte)(v >> 8);
+    p[3] = (png_byte)v;
+}
+
+// Хеш пикселей полосы, обрабатывает по 8 байт за шаг
+static uint64_t stripe_hash(png_bytep* rows, uint32_t first, uint32_t count, size_t rowbytes) {
+    uint64_t h = 1469598103934665603ull;
+
+    for (uint32_t y = first; y < first + count; y++) {
+        const png_byte* p = rows[y];
+        size_t i = 0;
+        for (; i + 8 <= rowbytes; i += 8) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            h = (h ^ w) * 1099511628211ull;
+            h ^= h >> 32;
+        }
+        for (; i < rowbytes; i++) {
+            h = (h ^ p[i]) * 1099511628211ull;
+        }
+    }
+
+    return h;
+}
+
+// Кэш из другого изображения или повреждённый кэш просто не используется
+static void load_cache(const char* cache_file, struct Png* image, struct StripeCache* cache) {
+    memset(cache, 0, sizeof(*cache));
+
+    FILE* probe = fopen(cache_file, "rb");
+    if (probe) {
+        fclose(probe);
+        if (map_input(cache_file, &cache->map, image->arena) == 0) {
+            const png_byte* data = cache->map.data;
+            size_t size = cache->map.size;
+            bool valid = size >= CACHE_HEADER_SIZE && memcmp(data, CACHE_MAGIC, 4) == 0 &&
+                         get_le32(data + 4) == CACHE_VERSION &&
+                         get_le32(data + 8) == image->width &&
+                         get_le32(data + 12) == image->height &&
+                         get_le32(data + 16) == STRIPE_ROWS;
+            uint32_t count = valid ? get_le32(data + 20) : 0;
+
+            valid = valid && count == (image->height + STRIPE_ROWS - 1) / STRIPE_ROWS &&
+                    (size - CACHE_HEADER_SIZE) / CACHE_ENTRY_SIZE >= count;
+            if (valid) {
+                cache->stripes = (struct Stripe*)arena_calloc(image->arena, count, sizeof(struct Stripe));
+                valid = cache->stripes != NULL;
+            }
+
+            size_t offset = CACHE_HEADER_SIZE + (size_t)count * CACHE_ENTRY_SIZE;
+            for (uint32_t i = 0; valid && i < count; i++) {
+                const png_byte* entry = data + CACHE_HEADER_SIZE + (size_t)i * CACHE_ENTRY_SIZE;
+                struct Stripe* stripe = &cache->stripes[i];
+                stripe->hash = get_le64(entry);
+                stripe->adler = get_le32(entry + 8);
+                stripe->raw_len = get_le64(entry + 16);
+                stripe->comp_len = get_le64(entry + 24);
+                stripe->data = data + offset;
+                valid = stripe->comp_len <= size - offset;
+                offset += stripe->comp_len;
+            }
+
+            if (valid) {
+                cache->count = count;
+            } else {
+                cache->stripes = NULL;
+                unmap_input(&cache->map);
+            }
+        }
+    }
+}
+
+static voidpf zlib_arena_alloc(voidpf opaque, uInt items, uInt size) {
+    return arena_malloc((struct Arena*)opaque, (size_t)items * size);
+}
+
+static void zlib_arena_free(voidpf opaque, voidpf address) {
+    arena_free((struct Arena*)opaque, address);
+}
+
+// Полоса сжимается с нуля (deflateReset) и завершается Z_FULL_FLUSH,
+// поэтому её байты можно вставлять между любыми другими полосами
+static int deflate_stripe(struct Png* image, z_stream* zs, uint32_t first, uint32_t count,
+                          png_bytep filtered, struct Stripe* stripe) {
+    int code = 0;
+    size_t rowbytes = (size_t)image->width * 4;
+    size_t raw_len = (rowbytes + 1) * count;
+
+    // Фильтр Sub зависит только от текущей строки и не связывает полосы между собой
+    for (uint32_t y = 0; y < count; y++) {
+        const png_byte* src = image->row_pointers[first + y];
+        png_bytep dst = filtered + (rowbytes + 1) * y;
+        dst[0] = 1;
+        memcpy(dst + 1, src, 4);
+        for (size_t i = 4; i < rowbytes; i++) {
+            dst[1 + i] = (png_byte)(src[i] - src[i - 4]);
+        }
+    }
+
+    if (deflateReset(zs) == Z_OK) {
+        size_t bound = deflateBound(zs, raw_len) + 16;
+        png_bytep compressed = (png_bytep)arena_alloc(image->arena, bound);
+        if (compressed) {
+            zs->next_in = filtered;
+            zs->avail_in = (uInt)raw_len;
+            zs->next_out = compressed;
+            zs->avail_out = (uInt)bound;
+            if (deflate(zs, Z_FULL_FLUSH) == Z_OK && zs->avail_in == 0) {
+                stripe->data = compressed;
+                stripe->comp_len = bound - zs->avail_out;
+                stripe->raw_len = raw_len;
+                stripe->adler = (uint32_t)adler32(adler32(0L, Z_NULL, 0), filtered, (uInt)raw_len);
+            } else {
+                code = ERR_FILE_IO;
+            }
+        } else {
+            code = ERR_FILE_IO;
+        }
+    } else {
+        code = ERR_FILE_IO;
+    }
+
+    return code;
+}
+
+static void write_chunk(struct OutBuf* out, const char* type, const png_byte* data, size_t length) {
+    png_byte header[8];
+    png_byte footer[4];
+    uLong crc = crc32(0L, (const Bytef*)type, 4);
+
+    if (length > 0) crc = crc32(crc, data, (uInt)length);
+    put_be32(header, (uint32_t)length);
+    memcpy(header + 4, type, 4);
+    put_be32(footer, (uint32_t)crc);
+
+    outbuf_write(out, header, sizeof(header));
+    if (length > 0) outbuf_write(out, data, length);
+    outbuf_write(out, footer, sizeof(footer));
+}
+
+static int save_cache(const char* cache_file, struct Png* image, struct Stripe* stripes, uint32_t count) {
+    char tmp_file[MAX_FILENAME_LENGTH + 8];
+    struct OutBuf out;
+    png_byte header[CACHE_HEADER_SIZE];
+    int code = 0;
+
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", cache_file);
+    memcpy(header, CACHE_MAGIC, 4);
+    put_le32(header + 4, CACHE_VERSION);
+    put_le32(header + 8, image->width);
+    put_le32(header + 12, image->height);
+    put_le32(header + 16, STRIPE_ROWS);
+    put_le32(header + 20, count);
+
+    code = outbuf_open(&out, tmp_file, image->arena);
+    if (code == 0) {
+        outbuf_write(&out, header, sizeof(header));
+        for (uint32_t i = 0; i < count; i++) {
+            png_byte entry[CACHE_ENTRY_SIZE];
+            put_le64(entry, stripes[i].hash);
+            put_le32(entry + 8, stripes[i].adler);
+            put_le32(entry + 12, 0);
+            put_le64(entry + 16, stripes[i].raw_len);
+            put_le64(entry + 24, stripes[i].comp_len);
+            outbuf_write(&out, entry, sizeof(entry));
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            outbuf_write(&out, stripes[i].data, stripes[i].comp_len);
+        }
+        code = outbuf_close(&out);
+        if (code == 0 && rename(tmp_file, cache_file) != 0) code = ERR_FILE_IO;
+        if (code != 0) remove(tmp_file);
+    }
+
+    if (code != 0) {
+        fprintf(stderr, "Cannot write cache file: %s\n", cache_file);
+    }
+    return code;
+}
+
+int write_png_cached(const char* filename, struct Png* image, const char* cache_file) {
+    struct StripeCache cache;
+    struct OutBuf out;
+    uint32_t count = (image->height + STRIPE_ROWS - 1) / STRIPE_ROWS;
+    size_t rowbytes = (size_t)image->width * 4;
+    struct Stripe* stripes = (struct Stripe*)arena_calloc(image->arena, count, sizeof(struct Stripe));
+    png_bytep filtered = (png_bytep)arena_alloc(image->arena, (rowbytes + 1) * STRIPE_ROWS);
+    bool zs_ready = false;
+    z_stream zs;
+    int code = 0;
+
+    load_cache(cache_file, image, &cache);
+
+    // Один поток zlib на все полосы: его состояние выделяется в scratch-арене один раз
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zlib_arena_alloc;
+    zs.zfree = zlib_arena_free;
+    zs.opaque = image->scratch;
+    zs_ready = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    if (!stripes || !filtered || !zs_ready) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        code = ERR_FILE_IO;
+    }
+
+    // Сжимаются только изменённые полосы и полосы, которых нет в кэше
+    for (uint32_t i = 0; i < count && code == 0; i++) {
+        uint32_t first = i * STRIPE_ROWS;
+        uint32_t rows = image->height - first < STRIPE_ROWS ? image->height - first : STRIPE_ROWS;
+        bool dirty = image->dirty && (int)first <= image->dirty_bottom && (int)(first + rows - 1) >= image->dirty_top;
+        uint64_t hash = stripe_hash(image->row_pointers, first, rows, rowbytes);
+
+        if (i < cache.count && !dirty && cache.stripes[i].hash == hash) {
+            stripes[i] = cache.stripes[i];
+        } else {
+            code = deflate_stripe(image, &zs, first, rows, filtered, &stripes[i]);
+            if (code != 0) fprintf(stderr, "Error compressing PNG data.\n");
+        }
+        stripes[i].hash = hash;
+    }
+
+    if (code == 0) {
+        code = outbuf_open(&out, filename, image->arena);
+    }
+
+    if (code == 0) {
+        static const png_byte signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        static const png_byte zlib_header[2] = { 0x78, 0x9c };
+        static const png_byte final_block[2] = { 0x03, 0x00 };
+        png_byte ihdr[13];
+        png_byte trailer[6];
+        uLong adler = adler32(0L, Z_NULL, 0);
+
+        put_be32(ihdr, image->width);
+        put_be32(ihdr + 4, image->height);
+        ihdr[8] = 8;
+        ihdr[9] = PNG_COLOR_TYPE_RGBA;
+        ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+        ihdr[11] = PNG_FILTER_TYPE_BASE;
+        ihdr[12] = PNG_INTERLACE_NONE;
+
+        outbuf_write(&out, signature, sizeof(signature));
+        write_chunk(&out, "IHDR", ihdr, sizeof(ihdr));
+        write_chunk(&out, "IDAT", zlib_header, sizeof(zlib_header));
+        for (uint32_t i = 0; i < count; i++) {
+            write_chunk(&out, "IDAT", stripes[i].data, stripes[i].comp_len);
+            adler = adler32_combine(adler, stripes[i].adler, (z_off_t)stripes[i].raw_len);
+        }
+
+        // Пустой последний блок deflate и контрольная сумма zlib
+        memcpy(trailer, final_block, 2);
+        put_be32(trailer + 2, (uint32_t)adler);
+        write_chunk(&out, "IDAT", trailer, sizeof(trailer));
+        write_chunk(&out, "IEND", NULL, 0);
+
+        code = outbuf_close(&out);
+        if (code != 0) fprintf(stderr, "Cannot write file: %s\n", filename);
+    }
+
+    if (code == 0) {
+        code = save_cache(cache_file, image, stripes, count);
+    }
+
+    if (zs_ready) deflateEnd(&zs);
+    unmap_input(&cache.map);
+    return code;
+}
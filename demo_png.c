@@ -10,8 +10,8 @@ void print_help() {
     printf("Course work for option 4.21, created by Yuliya Khalmetova.\n\n");
     printf("Options:\n");
     printf("  -h, --help                Show this help message\n");
-    printf("  -i, --info                Print PNG file info\n");
-    printf("  -o, --output FILE         Specify output file name (default: out.png)\n");
+    printf("  -i, --info                Print image file info\n");
+    printf("  -o, --output FILE         Specify output file name, - for stdout (default: out.png)\n");
     printf("      --rect                Draw rectangle\n");
     printf("      --left_up X.Y         Top-left corner of rectangle or source\n");
     printf("      --right_down X.Y      Bottom-right corner of rectangle or source\n");
@@ -24,29 +24,117 @@ void print_help() {
     printf("      --copy                Copy region\n");
     printf("      --dest_left_up X.Y    Destination point\n");
     printf("      --thickness N         Line thickness\n");
-    printf("      --input FILE          Input PNG file\n");
+    printf("      --input FILE          Input image file (PNG, PPM, PAM or QOI), - for stdin\n");
+    printf("      --format FMT          Output format: png, ppm, pam or qoi (default: png)\n");
+    printf("      --cache FILE          Reuse compressed PNG stripes from FILE and update it\n");
+    printf("      --flood X.Y           Flood fill the region containing the point with --color\n");
+    printf("      --tolerance N         Color tolerance for flood fill (0-255, default: 0)\n");
+    printf("      --blur                Blur the --left_up/--right_down region with --radius\n");
+    printf("      --blur_mode MODE      Blur mode: box or gauss (default: box)\n");
+    printf("      --replace_color R.G.B Replace this color with --replace_to (uses --tolerance)\n");
+    printf("      --replace_to R.G.B    Replacement color for --replace_color\n");
+    printf("      --lut FILE            Remap channels with a table of 256 lines \"R G B\"\n");
+    printf("      --stats-pixels        With --info: print per-channel pixel statistics as JSON\n");
+    printf("      --max-pixels N        Reject images with more than N pixels\n");
+    printf("      --mem-budget BYTES    Memory for the decoded image (suffix K, M or G); larger\n");
+    printf("                            images are processed in row bands (except --copy\n");
+    printf("                            and --flood)\n");
+}
+
+void print_pixel_stats(const struct Png *image, const struct PixelStats *stats) {
+    static const char *names[4] = { "r", "g", "b", "a" };
+
+    printf("{\n");
+    printf("  \"width\": %u,\n", image->width);
+    printf("  \"height\": %u,\n", image->height);
+    printf("  \"color_type\": %d,\n", image->color_type);
+    printf("  \"bit_depth\": %d,\n", image->bit_depth);
+    printf("  \"pixels\": %llu,\n", (unsigned long long)stats->pixels);
+    printf("  \"opaque\": %s,\n", stats->pixels == 0 || stats->min[3] == 255 ? "true" : "false");
+    printf("  \"channels\": {\n");
+    for (int c = 0; c < 4; c++) {
+        double mean = stats->pixels ? (double)stats->sum[c] / stats->pixels : 0.0;
+        printf("    \"%s\": {\n", names[c]);
+        printf("      \"min\": %d,\n", stats->pixels ? stats->min[c] : 0);
+        printf("      \"max\": %d,\n", stats->max[c]);
+        printf("      \"mean\": %.4f,\n", mean);
+        printf("      \"histogram\": [");
+        for (int v = 0; v < 256; v++) {
+            printf("%s%llu", v ? ", " : "", (unsigned long long)stats->histogram[c][v]);
+        }
+        printf("]\n");
+        printf("    }%s\n", c < 3 ? "," : "");
+    }
+    printf("  }\n");
+    printf("}\n");
 }
 
 int parse_coord_pair(const char *arg, int *x, int *y) {
     return sscanf(arg, "%d.%d", x, y) == 2 && *x >= 0 && *y >= 0;
 }
 
+int parse_color(const char *arg, struct Color *color) {
+    int r, g, b;
+    int ok = sscanf(arg, "%d.%d.%d", &r, &g, &b) == 3 &&
+             r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255;
+    if (ok) {
+        color->r = r;
+        color->g = g;
+        color->b = b;
+    }
+    return ok;
+}
+
+// Положительное число, для размеров памяти допускается суффикс K, M или G
+int parse_limit(const char *arg, uint64_t *value, int allow_suffix) {
+    unsigned long long number = 0;
+    char suffix = 0;
+    int fields = sscanf(arg, "%llu%c", &number, &suffix);
+    int ok = (fields == 1 || (fields == 2 && allow_suffix)) && number > 0 && arg[0] != '-';
+
+    if (ok && fields == 2) {
+        int shift = suffix == 'K' || suffix == 'k' ? 10 :
+                    suffix == 'M' || suffix == 'm' ? 20 :
+                    suffix == 'G' || suffix == 'g' ? 30 : -1;
+        ok = shift > 0 && number <= (UINT64_MAX >> shift);
+        if (ok) number <<= shift;
+    }
+    if (ok) {
+        *value = number;
+    }
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
     int code = 0;
 
     struct Png image = {0};
+    struct Arena arena, scratch;
     char *input_file = NULL;
     char *output_file = "out.png";
-    int do_info = 0, do_rect = 0, do_hex = 0, do_copy = 0;
-    int fill = 0, thickness = 1;
+    int do_info = 0, do_rect = 0, do_hex = 0, do_copy = 0, do_flood = 0, do_blur = 0;
+    int do_replace = 0, do_lut = 0, stats_pixels = 0, has_replace_to = 0;
+    int output_format = FORMAT_PNG;
+    char *cache_file = NULL;
+    char *lut_file = NULL;
+    int blur_mode = BLUR_BOX;
+    int fill = 0, thickness = 1, tolerance = 0;
 
     int rect_x1 = -1, rect_y1 = -1, rect_x2 = -1, rect_y2 = -1;
     int center_x = -1, center_y = -1, radius = -1;
     int src_x1 = -1, src_y1 = -1, src_x2 = -1, src_y2 = -1;
     int dest_x = -1, dest_y = -1;
+    int flood_x = -1, flood_y = -1;
 
     struct Color border_color = {0, 0, 0};
     struct Color fill_color = {255, 255, 255};
+    struct Color replace_from = {0, 0, 0};
+    struct Color replace_to = {0, 0, 0};
+
+    arena_init(&arena, 1 << 20);
+    arena_init(&scratch, 256 << 10);
+    image.arena = &arena;
+    image.scratch = &scratch;
 
     if (argc == 1) {
         print_help();
@@ -68,6 +156,18 @@ int main(int argc, char *argv[]) {
             {"dest_left_up", required_argument, NULL, OPT_DEST_LEFT_UP},
             {"thickness",    required_argument, NULL, OPT_THICKNESS},
             {"input",        required_argument, NULL, OPT_INPUT},
+            {"flood",        required_argument, NULL, OPT_FLOOD},
+            {"tolerance",    required_argument, NULL, OPT_TOLERANCE},
+            {"blur",         no_argument,       NULL, OPT_BLUR},
+            {"blur_mode",    required_argument, NULL, OPT_BLUR_MODE},
+            {"replace_color", required_argument, NULL, OPT_REPLACE_COLOR},
+            {"replace_to",   required_argument, NULL, OPT_REPLACE_TO},
+            {"lut",          required_argument, NULL, OPT_LUT},
+            {"stats-pixels", no_argument,       NULL, OPT_STATS_PIXELS},
+            {"format",       required_argument, NULL, OPT_FORMAT},
+            {"cache",        required_argument, NULL, OPT_CACHE},
+            {"max-pixels",   required_argument, NULL, OPT_MAX_PIXELS},
+            {"mem-budget",   required_argument, NULL, OPT_MEM_BUDGET},
             {0, 0, 0, 0}
         };
 
@@ -108,31 +208,19 @@ int main(int argc, char *argv[]) {
                     }
                     break;
                 }               
-                case OPT_COLOR: {
-                    int r, g, b;
-                    if (sscanf(optarg, "%d.%d.%d", &r, &g, &b) != 3 || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+                case OPT_COLOR:
+                    if (!parse_color(optarg, &border_color)) {
                         fprintf(stderr, "Invalid --color format.\n");
                         code = ERR_INVALID_COLOR_FORMAT;
-                    } else {
-                        border_color.r = r;
-                        border_color.g = g;
-                        border_color.b = b;
                     }
                     break;
-                }
                 case OPT_FILL: fill = 1; break;
-                case OPT_FILL_COLOR: {
-                    int r, g, b;
-                    if (sscanf(optarg, "%d.%d.%d", &r, &g, &b) != 3 || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+                case OPT_FILL_COLOR:
+                    if (!parse_color(optarg, &fill_color)) {
                         fprintf(stderr, "Error: Invalid format for --fill_color, expected R.G.B\n");
                         code = ERR_INVALID_COLOR_FORMAT;
-                    } else {
-                        fill_color.r = r;
-                        fill_color.g = g;
-                        fill_color.b = b;
                     }
                     break;
-                }
                 case OPT_HEXAGON: do_hex = 1; break;
                 case OPT_CENTER:
                     if (!parse_coord_pair(optarg, &center_x, &center_y)) {
@@ -141,11 +229,9 @@ int main(int argc, char *argv[]) {
                     }
                     break;
                 case OPT_RADIUS:
+                    // Проверяется после разбора: код ошибки зависит от действия
                     radius = atoi(optarg);
-                    if (radius <= 0) {
-                        fprintf(stderr, "Invalid value for --radius\n");
-                        code = ERR_INVALID_HEX_ARGS;
-                    }
+                    if (radius <= 0) radius = 0;
                     break;
                 case OPT_COPY: do_copy = 1; break;
                 case OPT_DEST_LEFT_UP:
@@ -162,6 +248,75 @@ int main(int argc, char *argv[]) {
                     }
                     break;
                 case OPT_INPUT: input_file = optarg; break;
+                case OPT_FLOOD:
+                    do_flood = 1;
+                    if (!parse_coord_pair(optarg, &flood_x, &flood_y)) {
+                        fprintf(stderr, "Invalid value for --flood\n");
+                        code = ERR_INVALID_COORD_FORMAT;
+                    }
+                    break;
+                case OPT_TOLERANCE:
+                    if (sscanf(optarg, "%d", &tolerance) != 1 || tolerance < 0 || tolerance > 255) {
+                        fprintf(stderr, "Invalid value for --tolerance\n");
+                        code = ERR_INVALID_TOLERANCE;
+                    }
+                    break;
+                case OPT_REPLACE_COLOR:
+                    do_replace = 1;
+                    if (!parse_color(optarg, &replace_from)) {
+                        fprintf(stderr, "Error: Invalid format for --replace_color, expected R.G.B\n");
+                        code = ERR_INVALID_COLOR_FORMAT;
+                    }
+                    break;
+                case OPT_REPLACE_TO:
+                    has_replace_to = 1;
+                    if (!parse_color(optarg, &replace_to)) {
+                        fprintf(stderr, "Error: Invalid format for --replace_to, expected R.G.B\n");
+                        code = ERR_INVALID_COLOR_FORMAT;
+                    }
+                    break;
+                case OPT_LUT:
+                    do_lut = 1;
+                    lut_file = optarg;
+                    break;
+                case OPT_STATS_PIXELS: stats_pixels = 1; break;
+                case OPT_CACHE:
+                    cache_file = optarg;
+                    if (strlen(cache_file) >= MAX_FILENAME_LENGTH) {
+                        fprintf(stderr, "Invalid value for --cache: file name is too long\n");
+                        code = ERR_FILE_IO;
+                    }
+                    break;
+                case OPT_FORMAT:
+                    output_format = parse_format(optarg);
+                    if (output_format == FORMAT_UNKNOWN) {
+                        fprintf(stderr, "Invalid value for --format, expected png, ppm, pam or qoi\n");
+                        code = ERR_INVALID_FORMAT;
+                    }
+                    break;
+                case OPT_MAX_PIXELS:
+                    if (!parse_limit(optarg, &image.max_pixels, 0)) {
+                        fprintf(stderr, "Invalid value for --max-pixels\n");
+                        code = ERR_LIMIT_EXCEEDED;
+                    }
+                    break;
+                case OPT_MEM_BUDGET:
+                    if (!parse_limit(optarg, &image.mem_budget, 1)) {
+                        fprintf(stderr, "Invalid value for --mem-budget, expected BYTES with optional K, M or G\n");
+                        code = ERR_LIMIT_EXCEEDED;
+                    }
+                    break;
+                case OPT_BLUR: do_blur = 1; break;
+                case OPT_BLUR_MODE:
+                    if (strcmp(optarg, "box") == 0) {
+                        blur_mode = BLUR_BOX;
+                    } else if (strcmp(optarg, "gauss") == 0) {
+                        blur_mode = BLUR_GAUSS;
+                    } else {
+                        fprintf(stderr, "Invalid value for --blur_mode, expected box or gauss\n");
+                        code = ERR_INVALID_BLUR_ARGS;
+                    }
+                    break;
                 default: 
                     fprintf(stderr, "Error: unknown option: %s\n", argv[optind - 1]);
                     code = ERR_UNKNOWN_OPTION;
@@ -179,22 +334,40 @@ int main(int argc, char *argv[]) {
             code = ERR_MISSING_INPUT_FILE;
         }
 
-        if (output_file && input_file && strcmp(output_file, input_file) == 0 && code == 0) {
+        if (output_file && input_file && strcmp(output_file, input_file) == 0 &&
+            strcmp(input_file, "-") != 0 && code == 0) {
             fprintf(stderr, "Error: input and output file must differ.\n");
             code = ERR_SAME_INPUT_OUTPUT;
         }
 
-        int actions = do_rect + do_hex + do_copy + do_info;
+        int actions = do_rect + do_hex + do_copy + do_flood + do_blur + do_replace + do_lut + do_info;
         if (actions != 1 && code == 0) {
             fprintf(stderr, "Error: only one action can be performed.\n");
             code = ERR_MULTIPLE_ACTIONS;
         }
 
-        if (code == 0) {
-            code = read_png_file(input_file, &image);
+        if (radius == 0 && code == 0) {
+            fprintf(stderr, "Invalid value for --radius\n");
+            code = do_blur ? ERR_INVALID_BLUR_ARGS : ERR_INVALID_HEX_ARGS;
+        }
+
+        if (stats_pixels && !do_info && code == 0) {
+            fprintf(stderr, "Error: --stats-pixels can only be used with --info.\n");
+            code = ERR_UNKNOWN_OPTION;
+        }
+
+        if (code == 0 && stats_pixels) {
+            struct PixelStats stats;
+            code = read_png_stats(input_file, &image, &stats);
+            if (code == 0) {
+                print_pixel_stats(&image, &stats);
+            }
+        } else if (code == 0) {
+            code = read_image_file(input_file, &image);
             if (code == 0) {
                 if (do_info) {
-                    printf("=== PNG Image Information ===\n");
+                    printf("=== Image Information ===\n");
+                    printf("Format: %s\n", format_name(image.input_format));
                     printf("Image size: %dx%d pixels\n", image.width, image.height);
                     printf("Color type: ");
                     switch (image.color_type) {
@@ -255,12 +428,63 @@ int main(int argc, char *argv[]) {
                         }
                     }
 
-                    if (code == 0) {
+                    if (do_flood && code == 0) {
+                        image.flood_mode = 1;
+                        image.flood_x = flood_x;
+                        image.flood_y = flood_y;
+                        image.flood_tolerance = tolerance;
+                        image.flood_color = border_color;
+                    }
+
+                    if (do_blur && code == 0) {
+                        if (src_x1 == -1 || src_y1 == -1 || src_x2 == -1 || src_y2 == -1 || radius == -1) {
+                            fprintf(stderr, "Error: --left_up, --right_down and --radius must be provided for blur.\n");
+                            code = ERR_INVALID_BLUR_ARGS;
+                        } else {
+                            image.blur_mode = blur_mode;
+                            image.blur_left = src_x1;
+                            image.blur_top = src_y1;
+                            image.blur_right = src_x2;
+                            image.blur_bottom = src_y2;
+                            image.blur_radius = radius;
+                        }
+                    }
+
+                    if (do_replace && code == 0 && !has_replace_to) {
+                        fprintf(stderr, "Error: --replace_to must be provided for --replace_color.\n");
+                        code = ERR_INVALID_COLOR_FORMAT;
+                    } else if (do_replace && code == 0) {
+                        image.replace_mode = 1;
+                        image.replace_from = replace_from;
+                        image.replace_to = replace_to;
+                        image.replace_tolerance = tolerance;
+                    }
+
+                    if (do_lut && code == 0) {
+                        code = load_lut(lut_file, image.lut);
+                        image.lut_mode = code == 0;
+                    }
+
+                    if (code == 0 && image.streaming) {
+                        // Кадр не помещается в --mem-budget: обработка полосами строк
+                        if (same_file(input_file, output_file)) {
+                            // Вход читается прямо из отображённого файла, пока пишется вывод
+                            fprintf(stderr, "Error: input and output file must differ.\n");
+                            code = ERR_SAME_INPUT_OUTPUT;
+                        } else {
+                            code = stream_image_rows(&image, output_file, output_format);
+                        }
+                    } else if (code == 0) {
                         process_file(&image);
                         if (image.error_code) {
                             code = image.error_code;
+                        } else if (!image.dirty && output_format == image.input_format) {
+                            // Ни один пиксель не изменился: файл копируется без перекодирования
+                            code = copy_input_file(&image.source, input_file, output_file, &arena);
+                        } else if (cache_file && output_format == FORMAT_PNG) {
+                            code = write_png_cached(output_file, &image, cache_file);
                         } else {
-                            code = write_png_file(output_file, &image);
+                            code = write_image_file(output_file, &image, output_format);
                         }
                     }
                 }
@@ -269,5 +493,7 @@ int main(int argc, char *argv[]) {
     }
 
     free_image(&image);
+    arena_release(&scratch);
+    arena_release(&arena);
     return code;
 }
\ No newline at end of file
@@ -0,0 +1,685 @@
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <png.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HEADER_SIZE 14
+#define IMAGE_PIXELS_MAX 400000000u
+
+static const png_byte qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+int detect_format(const png_byte* header, size_t size) {
+    int format = FORMAT_UNKNOWN;
+
+    if (size >= 8 && !png_sig_cmp((png_const_bytep)header, 0, 8)) {
+        format = FORMAT_PNG;
+    } else if (size >= 4 && memcmp(header, "qoif", 4) == 0) {
+        format = FORMAT_QOI;
+    } else if (size >= 2 && header[0] == 'P' && header[1] == '6') {
+        format = FORMAT_PPM;
+    } else if (size >= 2 && header[0] == 'P' && header[1] == '7') {
+        format = FORMAT_PAM;
+    }
+
+    return format;
+}
+
+int parse_format(const char* name) {
+    int format = FORMAT_UNKNOWN;
+
+    if (strcmp(name, "png") == 0) format = FORMAT_PNG;
+    else if (strcmp(name, "ppm") == 0) format = FORMAT_PPM;
+    else if (strcmp(name, "pam") == 0) format = FORMAT_PAM;
+    else if (strcmp(name, "qoi") == 0) format = FORMAT_QOI;
+
+    return format;
+}
+
+const char* format_name(int format) {
+    switch (format) {
+        case FORMAT_PNG: return "PNG";
+        case FORMAT_PPM: return "PPM";
+        case FORMAT_PAM: return "PAM";
+        case FORMAT_QOI: return "QOI";
+        default:         return "Unknown";
+    }
+}
+
+// Размеры из заголовка. Кадр, который не помещается в --mem-budget, не выделяется:
+// его обработает stream_image_rows полосами строк
+static int set_frame_size(struct Png* image, uint32_t width, uint32_t height) {
+    int code = 0;
+
+    if ((uint64_t)width * height > IMAGE_PIXELS_MAX) {
+        fprintf(stderr, "Unsupported image size: %ux%u.\n", width, height);
+        code = ERR_INVALID_FORMAT;
+    } else {
+        image->width = width;
+        image->height = height;
+        image->channels = 4;
+        image->bit_depth = 8;
+        code = check_image_limits(image, (uint64_t)height * ((uint64_t)width * 4 + sizeof(png_bytep)), true);
+    }
+
+    return code;
+}
+
+// Кадр в памяти всегда RGBA 8 бит, строки в одном непрерывном буфере
+static int alloc_pixels(struct Png* image) {
+    int code = 0;
+    size_t rowbytes = (size_t)image->width * 4;
+
+    image->row_pointers = (png_bytep*)arena_alloc(image->arena, sizeof(png_bytep) * image->height);
+    image->pixels = (png_bytep)arena_alloc(image->arena, rowbytes * image->height);
+    if (image->row_pointers && image->pixels) {
+        for (uint32_t y = 0; y < image->height; y++) {
+            image->row_pointers[y] = image->pixels + rowbytes * y;
+        }
+    } else {
+        fprintf(stderr, "Failed to allocate memory for pixel data.\n");
+        free_image(image);
+        code = ERR_FILE_IO;
+    }
+
+    return code;
+}
+
+// Построчное чтение входа в RGBA 8 бит: и для кадра в памяти, и для полос при потоковой обработке
+struct RowReader {
+    int format;
+    struct Png* image;
+    const png_byte* data;
+    size_t size;
+    size_t pos;                 // начало следующей строки (PPM, PAM) или следующего чанка QOI
+    uint32_t depth;             // каналов на пиксель в PPM и PAM
+    png_byte qoi_index[64][4];
+    png_byte qoi_px[4];
+    int qoi_run;
+    struct PngRowReader* png;
+};
+
+// Следующее число заголовка PNM, пропуская пробелы и комментарии
+static bool pnm_token(const png_byte* data, size_t size, size_t* pos, uint32_t* value) {
+    bool ok = false;
+    uint64_t v = 0;
+
+    while (*pos < size && (data[*pos] == '#' || data[*pos] == ' ' || data[*pos] == '\t' ||
+                           data[*pos] == '\r' || data[*pos] == '\n')) {
+        if (data[*pos] == '#') {
+            while (*pos < size && data[*pos] != '\n') (*pos)++;
+        } else {
+            (*pos)++;
+        }
+    }
+    while (*pos < size && data[*pos] >= '0' && data[*pos] <= '9' && v <= 0xffffffffu) {
+        v = v * 10 + (data[*pos] - '0');
+        (*pos)++;
+        ok = true;
+    }
+
+    *value = (uint32_t)v;
+    return ok && v <= 0xffffffffu;
+}
+
+static int read_ppm_header(struct RowReader* reader, struct Png* image) {
+    const png_byte* data = reader->data;
+    size_t size = reader->size;
+    size_t pos = 2;
+    uint32_t width, height, maxval;
+    int code = 0;
+
+    if (!pnm_token(data, size, &pos, &width) || !pnm_token(data, size, &pos, &height) ||
+        !pnm_token(data, size, &pos, &maxval) || pos >= size) {
+        fprintf(stderr, "Invalid PPM header.\n");
+        code = ERR_INVALID_FORMAT;
+    } else if (width == 0 || height == 0) {
+        fprintf(stderr, "Invalid PPM size: %ux%u.\n", width, height);
+        code = ERR_INVALID_FORMAT;
+    } else if (maxval != 255) {
+        fprintf(stderr, "Only 8-bit PPM files are supported (maxval %u).\n", maxval);
+        code = ERR_INVALID_FORMAT;
+    } else {
+        pos++;
+        if ((size - pos) / 3 / width < height) {
+            fprintf(stderr, "PPM pixel data is truncated.\n");
+            code = ERR_INVALID_FORMAT;
+        } else {
+            reader->pos = pos;
+            reader->depth = 3;
+            image->color_type = PNG_COLOR_TYPE_RGB;
+            code = set_frame_size(image, width, height);
+        }
+    }
+
+    return code;
+}
+
+static int read_pam_header(struct RowReader* reader, struct Png* image) {
+    const png_byte* data = reader->data;
+    size_t size = reader->size;
+    size_t pos = 2;
+    uint32_t width = 0, height = 0, depth = 0, maxval = 0;
+    bool header_done = false;
+    int code = 0;
+
+    // Заголовок PAM: строки "КЛЮЧ значение" до ENDHDR
+    while (code == 0 && !header_done && pos < size) {
+        size_t end = pos;
+        while (end < size && data[end] != '\n') end++;
+        const char* line = (const char*)data + pos;
+        size_t length = end - pos;
+
+        if (length >= 6 && memcmp(line, "ENDHDR", 6) == 0) {
+            header_done = true;
+        } else if (length > 6 && memcmp(line, "WIDTH ", 6) == 0) {
+            size_t p = pos + 5;
+            if (!pnm_token(data, end, &p, &width)) code = ERR_INVALID_FORMAT;
+        } else if (length > 7 && memcmp(line, "HEIGHT ", 7) == 0) {
+            size_t p = pos + 6;
+            if (!pnm_token(data, end, &p, &height)) code = ERR_INVALID_FORMAT;
+        } else if (length > 6 && memcmp(line, "DEPTH ", 6) == 0) {
+            size_t p = pos + 5;
+            if (!pnm_token(data, end, &p, &depth)) code = ERR_INVALID_FORMAT;
+        } else if (length > 7 && memcmp(line, "MAXVAL ", 7) == 0) {
+            size_t p = pos + 6;
+            if (!pnm_token(data, end, &p, &maxval)) code = ERR_INVALID_FORMAT;
+        }
+        pos = end + 1;
+    }
+
+    if (code != 0 || !header_done) {
+        fprintf(stderr, "Invalid PAM header.\n");
+        code = ERR_INVALID_FORMAT;
+    } else if (width == 0 || height == 0) {
+        fprintf(stderr, "Invalid PAM size: %ux%u.\n", width, height);
+        code = ERR_INVALID_FORMAT;
+    } else if (maxval != 255 || depth < 1 || depth > 4) {
+        fprintf(stderr, "Only 8-bit PAM files with 1 to 4 channels are supported.\n");
+        code = ERR_INVALID_FORMAT;
+    } else if (pos > size || (size - pos) / depth / width < height) {
+        fprintf(stderr, "PAM pixel data is truncated.\n");
+        code = ERR_INVALID_FORMAT;
+    } else {
+        static const int color_types[5] = { 0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+                                            PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA };
+        reader->pos = pos;
+        reader->depth = depth;
+        image->color_type = color_types[depth];
+        code = set_frame_size(image, width, height);
+    }
+
+    return code;
+}
+
+// Строка PPM или PAM; длина данных проверена по заголовку
+static void read_pnm_row(struct RowReader* reader, png_bytep dst, uint32_t width) {
+    const png_byte* src = reader->data + reader->pos;
+    uint32_t depth = reader->depth;
+
+    if (depth == 3) {
+        for (uint32_t x = 0; x < width; x++) {
+            dst[x * 4 + 0] = src[x * 3 + 0];
+            dst[x * 4 + 1] = src[x * 3 + 1];
+            dst[x * 4 + 2] = src[x * 3 + 2];
+            dst[x * 4 + 3] = 255;
+        }
+    } else {
+        for (uint32_t x = 0; x < width; x++) {
+            const png_byte* px = src + (size_t)x * depth;
+            if (depth <= 2) {
+                dst[x * 4 + 0] = dst[x * 4 + 1] = dst[x * 4 + 2] = px[0];
+                dst[x * 4 + 3] = depth == 2 ? px[1] : 255;
+            } else {
+                dst[x * 4 + 0] = px[0];
+                dst[x * 4 + 1] = px[1];
+                dst[x * 4 + 2] = px[2];
+                dst[x * 4 + 3] = px[3];
+            }
+        }
+    }
+    reader->pos += (size_t)width * depth;
+}
+
+static uint32_t read_be32(const png_byte* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write_be32(png_bytep p, uint32_t v) {
+    p[0] = (png_byte)(v >> 24);
+    p[1] = (png_byte)(v >> 16);
+    p[2] = (png_byte)(v >> 8);
+    p[3] = (png_byte)v;
+}
+
+static inline int qoi_hash(const png_byte* px) {
+    return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+}
+
+static int read_qoi_header(struct RowReader* reader, struct Png* image) {
+    const png_byte* data = reader->data;
+    int code = 0;
+
+    if (reader->size < QOI_HEADER_SIZE + sizeof(qoi_padding)) {
+        fprintf(stderr, "Invalid QOI header.\n");
+        code = ERR_INVALID_FORMAT;
+    } else {
+        uint32_t width = read_be32(data + 4);
+        uint32_t height = read_be32(data + 8);
+        int channels = data[12];
+
+        if (width == 0 || height == 0) {
+            fprintf(stderr, "Invalid QOI size: %ux%u.\n", width, height);
+            code = ERR_INVALID_FORMAT;
+        } else if (channels != 3 && channels != 4) {
+            fprintf(stderr, "Invalid QOI channel count: %d.\n", channels);
+            code = ERR_INVALID_FORMAT;
+        } else {
+            memset(reader->qoi_index, 0, sizeof(reader->qoi_index));
+            memset(reader->qoi_px, 0, 3);
+            reader->qoi_px[3] = 255;
+            reader->qoi_run = 0;
+            reader->pos = QOI_HEADER_SIZE;
+            image->color_type = channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+            code = set_frame_size(image, width, height);
+        }
+    }
+
+    return code;
+}
+
+// Серия и таблица индексов продолжаются со строки на строку
+static void read_qoi_row(struct RowReader* reader, png_bytep out, uint32_t width) {
+    const png_byte* data = reader->data;
+    size_t limit = reader->size - sizeof(qoi_padding);
+    size_t pos = reader->pos;
+    png_bytep px = reader->qoi_px;
+    int run = reader->qoi_run;
+
+    for (uint32_t i = 0; i < width; i++) {
+        if (run > 0) {
+            run--;
+        } else if (pos < limit) {
+            int b1 = data[pos++];
+            if (b1 == QOI_OP_RGB) {
+                if (pos + 3 <= limit) memcpy(px, data + pos, 3);
+                pos += 3;
+            } else if (b1 == QOI_OP_RGBA) {
+                if (pos + 4 <= limit) memcpy(px, data + pos, 4);
+                pos += 4;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                memcpy(px, reader->qoi_index[b1], 4);
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                px[0] += ((b1 >> 4) & 0x03) - 2;
+                px[1] += ((b1 >> 2) & 0x03) - 2;
+                px[2] += (b1 & 0x03) - 2;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                int b2 = pos < limit ? data[pos] : 0;
+                int vg = (b1 & 0x3f) - 32;
+                pos++;
+                px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += vg;
+                px[2] += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+            memcpy(reader->qoi_index[qoi_hash(px)], px, 4);
+        }
+        memcpy(out + (size_t)i * 4, px, 4);
+    }
+
+    reader->pos = pos;
+    reader->qoi_run = run;
+}
+
+// Разбирает заголовок и заполняет размеры image; при image->streaming кадр не выделяется
+int row_reader_open(struct RowReader** result, struct Png* image, const png_byte* data, size_t size) {
+    struct RowReader* reader = (struct RowReader*)arena_calloc(image->arena, 1, sizeof(struct RowReader));
+    int code = 0;
+
+    *result = reader;
+    if (!reader) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        code = ERR_FILE_IO;
+    } else {
+        reader->format = detect_format(data, size);
+        reader->image = image;
+        reader->data = data;
+        reader->size = size;
+
+        if (reader->format == FORMAT_PNG) {
+            code = png_row_reader_open(&reader->png, image, data, size);
+        } else if (reader->format == FORMAT_PPM) {
+            code = read_ppm_header(reader, image);
+        } else if (reader->format == FORMAT_PAM) {
+            code = read_pam_header(reader, image);
+        } else if (reader->format == FORMAT_QOI) {
+            code = read_qoi_header(reader, image);
+        } else {
+            fprintf(stderr, "Unsupported input format.\n");
+            code = ERR_FILE_IO;
+        }
+    }
+
+    return code;
+}
+
+// Следующие count строк сверху вниз
+int row_reader_read(struct RowReader* reader, png_bytep* rows, uint32_t count) {
+    uint32_t width = reader->image->width;
+    int code = 0;
+
+    if (reader->format == FORMAT_PNG) {
+        code = png_row_reader_read(reader->png, reader->image, rows, count);
+    } else if (reader->format == FORMAT_QOI) {
+        for (uint32_t i = 0; i < count; i++) {
+            read_qoi_row(reader, rows[i], width);
+        }
+        if (reader->pos > reader->size - sizeof(qoi_padding)) {
+            fprintf(stderr, "QOI pixel data is truncated.\n");
+            code = ERR_INVALID_FORMAT;
+        }
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            read_pnm_row(reader, rows[i], width);
+        }
+    }
+
+    return code;
+}
+
+void row_reader_close(struct RowReader* reader) {
+    if (reader && reader->png) {
+        png_row_reader_close(reader->image);
+    }
+}
+
+int read_image_data(const char* name, const png_byte* data, size_t size, struct Png* image) {
+    int code = 0;
+    int format = detect_format(data, size);
+
+    if (format == FORMAT_PNG) {
+        code = read_png_data(name, data, size, image);
+    } else if (format != FORMAT_UNKNOWN) {
+        struct RowReader* reader = NULL;
+        code = row_reader_open(&reader, image, data, size);
+        if (code == 0 && !image->streaming) {
+            code = alloc_pixels(image);
+            if (code == 0) {
+                code = row_reader_read(reader, image->row_pointers, image->height);
+            }
+        }
+        row_reader_close(reader);
+    } else {
+        fprintf(stderr, "Error: %s is not a PNG, PPM, PAM or QOI file.\n", name);
+        code = ERR_FILE_IO;
+    }
+
+    if (code == 0) {
+        image->input_format = format;
+    }
+    return code;
+}
+
+// Исходные байты остаются в image->source, чтобы неизменённый кадр можно было просто скопировать
+int read_image_file(const char* filename, struct Png* image) {
+    int code = map_input(filename, &image->source, image->arena);
+
+    if (code == 0) {
+        code = read_image_data(filename, image->source.data, image->source.size, image);
+    }
+
+    return code;
+}
+
+struct QoiEncoder {
+    png_byte index[64][4];
+    png_byte prev[4];
+    int run;
+};
+
+// Кодирует одну строку; серия может продолжаться на следующей строке
+static size_t qoi_encode_row(struct QoiEncoder* enc, const png_byte* row, uint32_t width, png_bytep out) {
+    size_t n = 0;
+
+    for (uint32_t x = 0; x < width; x++) {
+        const png_byte* px = row + (size_t)x * 4;
+
+        if (memcmp(px, enc->prev, 4) == 0) {
+            enc->run++;
+            if (enc->run == 62) {
+                out[n++] = QOI_OP_RUN | (enc->run - 1);
+                enc->run = 0;
+            }
+        } else {
+            int h = qoi_hash(px);
+
+            if (enc->run > 0) {
+                out[n++] = QOI_OP_RUN | (enc->run - 1);
+                enc->run = 0;
+            }
+
+            if (memcmp(enc->index[h], px, 4) == 0) {
+                out[n++] = QOI_OP_INDEX | h;
+            } else {
+                memcpy(enc->index[h], px, 4);
+                if (px[3] == enc->prev[3]) {
+                    signed char vr = px[0] - enc->prev[0];
+                    signed char vg = px[1] - enc->prev[1];
+                    signed char vb = px[2] - enc->prev[2];
+                    signed char vg_r = vr - vg;
+                    signed char vg_b = vb - vg;
+
+                    if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        out[n++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                    } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                        out[n++] = QOI_OP_LUMA | (vg + 32);
+                        out[n++] = (vg_r + 8) << 4 | (vg_b + 8);
+                    } else {
+                        out[n++] = QOI_OP_RGB;
+                        out[n++] = px[0];
+                        out[n++] = px[1];
+                        out[n++] = px[2];
+                    }
+                } else {
+                    out[n++] = QOI_OP_RGBA;
+                    memcpy(out + n, px, 4);
+                    n += 4;
+                }
+            }
+            memcpy(enc->prev, px, 4);
+        }
+    }
+
+    return n;
+}
+
+// Строки пишутся по одной, поэтому годится и для кадра, который целиком в памяти не держится
+struct RowWriter {
+    struct OutBuf out;
+    int format;
+    uint32_t width;
+    png_bytep encoded;          // строка в формате вывода (PPM, QOI)
+    struct QoiEncoder qoi;
+    png_structp png_ptr;
+    png_infop info_ptr;
+};
+
+static int png_row_writer_begin(struct RowWriter* writer, struct Png* image) {
+    int code = 0;
+
+    writer->png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                                image->scratch, png_arena_malloc, png_arena_free);
+    if (writer->png_ptr) {
+        writer->info_ptr = png_create_info_struct(writer->png_ptr);
+    }
+
+    if (!writer->png_ptr || !writer->info_ptr) {
+        fprintf(stderr, "Error creating PNG write structure\n");
+        code = ERR_FILE_IO;
+    } else if (!setjmp(png_jmpbuf(writer->png_ptr))) {
+        png_set_write_fn(writer->png_ptr, &writer->out, png_write_outbuf, png_flush_outbuf);
+        png_set_IHDR(writer->png_ptr, writer->info_ptr, image->width, image->height, 8,
+                     PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        png_write_info(writer->png_ptr, writer->info_ptr);
+    } else {
+        fprintf(stderr, "libpng error during writing PNG.\n");
+        code = ERR_FILE_IO;
+    }
+
+    return code;
+}
+
+static void write_header(struct RowWriter* writer, struct Png* image) {
+    char header[128];
+    int length = 0;
+
+    if (writer->format == FORMAT_PPM) {
+        length = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", image->width, image->height);
+    } else if (writer->format == FORMAT_PAM) {
+        length = snprintf(header, sizeof(header),
+                          "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                          image->width, image->height);
+    } else {
+        memcpy(header, "qoif", 4);
+        write_be32((png_bytep)header + 4, image->width);
+        write_be32((png_bytep)header + 8, image->height);
+        header[12] = 4;
+        header[13] = 0;
+        length = QOI_HEADER_SIZE;
+    }
+    outbuf_write(&writer->out, header, length);
+}
+
+int row_writer_open(struct RowWriter** result, const char* filename, struct Png* image, int format) {
+    struct RowWriter* writer = (struct RowWriter*)arena_calloc(image->arena, 1, sizeof(struct RowWriter));
+    int code = 0;
+
+    *result = writer;
+    if (!writer) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        code = ERR_FILE_IO;
+    } else {
+        writer->format = format;
+        writer->width = image->width;
+        writer->out.fd = -1;
+        writer->qoi.prev[3] = 255;
+        code = outbuf_open(&writer->out, filename, image->arena);
+    }
+
+    if (code == 0) {
+        if (format == FORMAT_PNG) {
+            code = png_row_writer_begin(writer, image);
+        } else {
+            // Худший случай QOI — 5 байт на пиксель плюс отложенная серия
+            writer->encoded = (png_bytep)arena_alloc(image->arena, (size_t)image->width * 5 + 1);
+            if (writer->encoded) {
+                write_header(writer, image);
+            } else {
+                fprintf(stderr, "Memory allocation failed.\n");
+                code = ERR_FILE_IO;
+            }
+        }
+    }
+
+    return code;
+}
+
+int row_writer_write(struct RowWriter* writer, const png_byte* row) {
+    int code = 0;
+
+    if (writer->format == FORMAT_PNG) {
+        if (!setjmp(png_jmpbuf(writer->png_ptr))) {
+            png_write_row(writer->png_ptr, row);
+        } else {
+            fprintf(stderr, "libpng error during writing PNG.\n");
+            code = ERR_FILE_IO;
+        }
+    } else if (writer->format == FORMAT_PPM) {
+        for (uint32_t x = 0; x < writer->width; x++) {
+            writer->encoded[x * 3 + 0] = row[x * 4 + 0];
+            writer->encoded[x * 3 + 1] = row[x * 4 + 1];
+            writer->encoded[x * 3 + 2] = row[x * 4 + 2];
+        }
+        outbuf_write(&writer->out, writer->encoded, (size_t)writer->width * 3);
+    } else if (writer->format == FORMAT_PAM) {
+        outbuf_write(&writer->out, row, (size_t)writer->width * 4);
+    } else {
+        size_t n = qoi_encode_row(&writer->qoi, row, writer->width, writer->encoded);
+        outbuf_write(&writer->out, writer->encoded, n);
+    }
+
+    return code;
+}
+
+// Вызов libpng вынесен отдельно: в row_writer_close код ошибки меняется после setjmp
+static int png_row_writer_end(struct RowWriter* writer) {
+    int code = 0;
+
+    if (!setjmp(png_jmpbuf(writer->png_ptr))) {
+        png_write_end(writer->png_ptr, NULL);
+    } else {
+        code = ERR_FILE_IO;
+    }
+
+    return code;
+}
+
+// Завершает файл и закрывает вывод; вызывается и после ошибки
+int row_writer_close(struct RowWriter* writer, const char* filename) {
+    int code = 0;
+
+    if (writer) {
+        if (writer->format == FORMAT_PNG && writer->png_ptr && writer->info_ptr) {
+            code = png_row_writer_end(writer);
+        } else if (writer->format == FORMAT_QOI && writer->encoded) {
+            if (writer->qoi.run > 0) {
+                writer->encoded[0] = QOI_OP_RUN | (writer->qoi.run - 1);
+                outbuf_write(&writer->out, writer->encoded, 1);
+            }
+            outbuf_write(&writer->out, qoi_padding, sizeof(qoi_padding));
+        }
+
+        if (writer->png_ptr && writer->info_ptr) {
+            png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+        } else if (writer->png_ptr) {
+            png_destroy_write_struct(&writer->png_ptr, NULL);
+        }
+
+        if (writer->out.fd >= 0) {
+            int close_code = outbuf_close(&writer->out);
+            if (code == 0) code = close_code;
+        }
+        if (code != 0) fprintf(stderr, "Error writing %s file: %s\n", format_name(writer->format), filename);
+    }
+
+    return code;
+}
+
+int write_image_file(const char* filename, struct Png* image, int format) {
+    int code = 0;
+
+    if (format == FORMAT_PNG) {
+        code = write_png_file(filename, image);
+    } else {
+        struct RowWriter* writer = NULL;
+        code = row_writer_open(&writer, filename, image, format);
+        for (uint32_t y = 0; y < image->height && code == 0; y++) {
+            code = row_writer_write(writer, image->row_pointers[y]);
+        }
+
+        int close_code = row_writer_close(writer, filename);
+        if (code == 0) code = close_code;
+    }
+
+    return code;
+}
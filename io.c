@@ -0,0 +1,239 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#define OUTBUF_ALIGN 4096
+#define OUTBUF_SIZE (1 << 20)
+#define STDIN_CHUNK (1 << 20)
+
+static bool is_stdio_name(const char* filename) {
+    return strcmp(filename, "-") == 0;
+}
+
+// Один и тот же файл под разными именами (./a.png, жёсткая ссылка, перенаправленный stdout)
+bool same_file(const char* input_file, const char* output_file) {
+    struct stat in_st, out_st;
+    bool same = false;
+
+    if (!is_stdio_name(input_file) && stat(input_file, &in_st) == 0) {
+        int status = is_stdio_name(output_file) ? fstat(STDOUT_FILENO, &out_st) : stat(output_file, &out_st);
+        same = status == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino;
+    }
+    return same;
+}
+
+// Читает поток до конца в растущий буфер (stdin, каналы).
+// Буфер растёт через arena_realloc: крупный кусок расширяется на месте, без старых копий.
+static int slurp_fd(int fd, struct InputMap* map, struct Arena* arena) {
+    size_t capacity = STDIN_CHUNK;
+    int code = 0;
+
+    map->arena = arena;
+    map->data = (png_bytep)arena_malloc(arena, capacity);
+    map->size = 0;
+    while (code == 0 && map->data) {
+        if (map->size == capacity) {
+            png_bytep grown = (png_bytep)arena_realloc(arena, map->data, capacity * 2);
+            if (grown) {
+                map->data = grown;
+                capacity *= 2;
+            } else {
+                code = ERR_FILE_IO;
+            }
+        }
+        if (code == 0) {
+            ssize_t n = read(fd, map->data + map->size, capacity - map->size);
+            if (n > 0) map->size += n;
+            else if (n == 0) break;
+            else if (errno != EINTR) code = ERR_FILE_IO;
+        }
+    }
+    if (!map->data) code = ERR_FILE_IO;
+
+    return code;
+}
+
+int map_input(const char* filename, struct InputMap* map, struct Arena* arena) {
+    int code = 0;
+    int fd = is_stdio_name(filename) ? STDIN_FILENO : open(filename, O_RDONLY);
+    struct stat st;
+
+    memset(map, 0, sizeof(*map));
+
+    if (fd < 0) {
+        code = ERR_FILE_IO;
+    } else if (fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            map->data = (png_bytep)data;
+            map->size = st.st_size;
+            map->mapped = 1;
+        } else {
+            code = slurp_fd(fd, map, arena);
+        }
+    } else {
+        code = slurp_fd(fd, map, arena);
+    }
+
+    if (fd > STDIN_FILENO) close(fd);
+    if (code != 0) {
+        fprintf(stderr, "Cannot read file: %s\n", filename);
+        unmap_input(map);
+    }
+    return code;
+}
+
+void unmap_input(struct InputMap* map) {
+    if (map->data && map->mapped) {
+        munmap(map->data, map->size);
+    } else if (map->data) {
+        arena_free(map->arena, map->data);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+int outbuf_open(struct OutBuf* out, const char* filename, struct Arena* arena) {
+    int code = 0;
+    void* buf = NULL;
+
+    memset(out, 0, sizeof(*out));
+    out->fd = is_stdio_name(filename) ? STDOUT_FILENO : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (out->fd < 0) {
+        fprintf(stderr, "Cannot open file: %s\n", filename);
+        code = ERR_FILE_IO;
+    } else if ((buf = arena_alloc_aligned(arena, OUTBUF_SIZE, OUTBUF_ALIGN)) == NULL) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        if (out->fd != STDOUT_FILENO) close(out->fd);
+        out->fd = -1;
+        code = ERR_FILE_IO;
+    } else {
+        out->buf = (png_bytep)buf;
+        out->capacity = OUTBUF_SIZE;
+    }
+
+    return code;
+}
+
+static void write_all(struct OutBuf* out, const png_byte* data, size_t size) {
+    while (size > 0 && !out->error) {
+        ssize_t n = write(out->fd, data, size);
+        if (n > 0) {
+            data += n;
+            size -= n;
+        } else if (n < 0 && errno != EINTR) {
+            out->error = 1;
+        }
+    }
+}
+
+void outbuf_flush(struct OutBuf* out) {
+    if (out->size > 0) {
+        write_all(out, out->buf, out->size);
+        out->size = 0;
+    }
+}
+
+void outbuf_write(struct OutBuf* out, const void* data, size_t size) {
+    const png_byte* src = (const png_byte*)data;
+
+    if (out->size + size > out->capacity) {
+        outbuf_flush(out);
+    }
+    // Большие блоки пишутся напрямую, минуя буфер
+    if (size >= out->capacity) {
+        write_all(out, src, size);
+    } else {
+        memcpy(out->buf + out->size, src, size);
+        out->size += size;
+    }
+}
+
+int outbuf_close(struct OutBuf* out) {
+    int code = 0;
+
+    if (out->fd >= 0) {
+        outbuf_flush(out);
+        if (out->fd != STDOUT_FILENO && close(out->fd) != 0) out->error = 1;
+    }
+    out->buf = NULL;
+    out->fd = -1;
+
+    if (out->error) code = ERR_FILE_IO;
+    return code;
+}
+
+#ifdef __linux__
+// Reflink (FICLONE), а если файловая система не умеет — copy_file_range внутри ядра
+static bool clone_file(const char* input_file, const char* output_file, size_t size) {
+    bool copied = false;
+    int in = open(input_file, O_RDONLY);
+    int out = in >= 0 ? open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+
+    if (in >= 0 && out >= 0) {
+        if (ioctl(out, FICLONE, in) == 0) {
+            copied = true;
+        } else {
+            size_t done = 0;
+            bool failed = false;
+            while (done < size && !failed) {
+                ssize_t n = copy_file_range(in, NULL, out, NULL, size - done, 0);
+                if (n > 0) done += n;
+                else if (n == 0 || errno != EINTR) failed = true;
+            }
+            copied = done == size;
+        }
+    }
+
+    if (out >= 0) {
+        if (close(out) != 0) copied = false;
+    }
+    if (in >= 0) close(in);
+    return copied;
+}
+#endif
+
+int copy_input_file(const struct InputMap* source, const char* input_file, const char* output_file,
+                    struct Arena* arena) {
+    int code = 0;
+    bool copied = false;
+
+    // Выход совпадает с отображённым входом: O_TRUNC уничтожил бы исходные данные,
+    // а копировать нечего — содержимое и так то же самое
+    if (same_file(input_file, output_file)) {
+        copied = true;
+    }
+
+#ifdef __linux__
+    // Только для обычного файла: канал повторно прочитать нельзя
+    if (!copied && source->mapped && !is_stdio_name(output_file)) {
+        copied = clone_file(input_file, output_file, source->size);
+    }
+#endif
+
+    if (!copied) {
+        struct OutBuf out;
+        code = outbuf_open(&out, output_file, arena);
+        if (code == 0) {
+            outbuf_write(&out, source->data, source->size);
+            code = outbuf_close(&out);
+            if (code != 0) fprintf(stderr, "Cannot write file: %s\n", output_file);
+        }
+    }
+
+    return code;
+}
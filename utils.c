@@ -5,116 +5,489 @@
 #include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
-int read_png_file(const char* filename, struct Png* image) {
-    png_byte header[8];
-    FILE* fp = fopen(filename, "rb");
+// Разворачивает строку PNG в родном формате в RGBA 8 бит
+struct RowExpander {
+    void (*expand)(png_bytep dst, const png_byte* src, uint32_t width, const struct RowExpander* ex);
+    png_uint_16 key[3];             // цвет tRNS для серых и RGB изображений
+    png_byte table[256][4];         // палитра или серый меньше 8 бит -> RGBA
+    size_t rowbytes;                // размер строки в родном формате
+    png_bytep scratch;              // одна строка для построчного чтения
+    png_bytep frame;                // весь кадр, если PNG чересстрочный
+    uint32_t next_row;
+};
+
+static void expand_indexed(png_bytep restrict dst, const png_byte* restrict src, uint32_t width, const struct RowExpander* ex) {
+    for (size_t x = 0; x < width; x++) {
+        memcpy(dst + 4 * x, ex->table[src[x]], 4);
+    }
+}
+
+#define LOAD8(p) ((p)[0])
+#define LOAD16(p) (((p)[0] << 8) | (p)[1])
+
+// 16 -> 8 бит: берётся старший байт (как png_set_strip_16), ключ tRNS сравнивается по полному значению.
+// Шаг по исходной строке постоянный: с -O3 (utils.o, см. Makefile.txt) GCC векторизует
+// ядра gray_key, gray_alpha и rgb; gray и rgb_key на базовом x86-64 остаются скалярными.
+#define DEFINE_EXPAND_KERNELS(bits, step, LOAD)                                                               \
+    static void expand_gray##bits(png_bytep restrict dst, const png_byte* restrict src, uint32_t width,       \
+                                  const struct RowExpander* ex) {                                             \
+        (void)ex;                                                                                             \
+        for (size_t x = 0; x < width; x++) {                                                                  \
+            png_byte g = src[(step) * x];                                                                     \
+            dst[4 * x] = g; dst[4 * x + 1] = g; dst[4 * x + 2] = g; dst[4 * x + 3] = 255;                     \
+        }                                                                                                     \
+    }                                                                                                         \
+    static void expand_gray_key##bits(png_bytep restrict dst, const png_byte* restrict src, uint32_t width,   \
+                                      const struct RowExpander* ex) {                                         \
+        png_uint_16 key = ex->key[0];                                                                         \
+        for (size_t x = 0; x < width; x++) {                                                                  \
+            const png_byte* p = src + (step) * x;                                                             \
+            dst[4 * x] = p[0]; dst[4 * x + 1] = p[0]; dst[4 * x + 2] = p[0];                                  \
+            dst[4 * x + 3] = LOAD(p) == key ? 0 : 255;                                                        \
+        }                                                                                                     \
+    }                                                                                                         \
+    static void expand_gray_alpha##bits(png_bytep restrict dst, const png_byte* restrict src, uint32_t width, \
+                                        const struct RowExpander* ex) {                                       \
+        (void)ex;                                                                                             \
+        for (size_t x = 0; x < width; x++) {                                                                  \
+            const png_byte* p = src + 2 * (step) * x;                                                         \
+            dst[4 * x] = p[0]; dst[4 * x + 1] = p[0]; dst[4 * x + 2] = p[0];                                  \
+            dst[4 * x + 3] = p[step];                                                                         \
+        }                                                                                                     \
+    }                                                                                                         \
+    static void expand_rgb##bits(png_bytep restrict dst, const png_byte* restrict src, uint32_t width,        \
+                                 const struct RowExpander* ex) {                                              \
+        (void)ex;                                                                                             \
+        for (size_t x = 0; x < width; x++) {                                                                  \
+            const png_byte* p = src + 3 * (step) * x;                                                         \
+            dst[4 * x] = p[0]; dst[4 * x + 1] = p[step]; dst[4 * x + 2] = p[2 * (step)];                      \
+            dst[4 * x + 3] = 255;                                                                             \
+        }                                                                                                     \
+    }                                                                                                         \
+    static void expand_rgb_key##bits(png_bytep restrict dst, const png_byte* restrict src, uint32_t width,    \
+                                     const struct RowExpander* ex) {                                          \
+        png_uint_16 kr = ex->key[0], kg = ex->key[1], kb = ex->key[2];                                        \
+        for (size_t x = 0; x < width; x++) {                                                                  \
+            const png_byte* p = src + 3 * (step) * x;                                                         \
+            bool keyed = (LOAD(p) == kr) & (LOAD(p + (step)) == kg) & (LOAD(p + 2 * (step)) == kb);           \
+            dst[4 * x] = p[0]; dst[4 * x + 1] = p[step]; dst[4 * x + 2] = p[2 * (step)];                      \
+            dst[4 * x + 3] = keyed ? 0 : 255;                                                                 \
+        }                                                                                                     \
+    }
+
+DEFINE_EXPAND_KERNELS(8, 1, LOAD8)
+DEFINE_EXPAND_KERNELS(16, 2, LOAD16)
+
+// RGBA 8 бит читается прямо в кадр, разворачивать нужно только 16-битный
+static void expand_rgba16(png_bytep restrict dst, const png_byte* restrict src, uint32_t width,
+                          const struct RowExpander* ex) {
+    (void)ex;
+    for (size_t x = 0; x < 4 * width; x++) {
+        dst[x] = src[2 * x];
+    }
+}
+
+// Палитра (с прозрачностью из tRNS) и серый меньше 8 бит разворачиваются через таблицу
+static void build_expand_table(struct Png* image, struct RowExpander* ex) {
+    png_bytep trans_alpha = NULL;
+    int num_trans = 0;
+    png_color_16p trans_color = NULL;
+    bool has_trns = png_get_tRNS(image->png_ptr, image->info_ptr, &trans_alpha, &num_trans, &trans_color) != 0;
+
+    memset(ex->table, 0, sizeof(ex->table));
+    if (image->color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_colorp palette = NULL;
+        int num_palette = 0;
+        png_get_PLTE(image->png_ptr, image->info_ptr, &palette, &num_palette);
+        for (int i = 0; i < 256; i++) {
+            if (i < num_palette) {
+                ex->table[i][0] = palette[i].red;
+                ex->table[i][1] = palette[i].green;
+                ex->table[i][2] = palette[i].blue;
+            }
+            ex->table[i][3] = has_trns && trans_alpha && i < num_trans ? trans_alpha[i] : 255;
+        }
+    } else {
+        int max = (1 << image->bit_depth) - 1;
+        int key = has_trns && trans_color ? (trans_color->gray & max) : -1;
+        for (int i = 0; i <= max; i++) {
+            png_byte g = (png_byte)(i * 255 / max);
+            ex->table[i][0] = g;
+            ex->table[i][1] = g;
+            ex->table[i][2] = g;
+            ex->table[i][3] = i == key ? 0 : 255;
+        }
+    }
+}
+
+// Строки читаются в родном формате: libpng только распаковывает отсчёты меньше 8 бит в байты
+static void setup_native_read(struct Png* image, struct RowExpander* ex) {
+    png_bytep trans_alpha = NULL;
+    int num_trans = 0;
+    png_color_16p trans_color = NULL;
+    bool keyed;
+    bool wide;
+
+    image->width = png_get_image_width(image->png_ptr, image->info_ptr);
+    image->height = png_get_image_height(image->png_ptr, image->info_ptr);
+    image->color_type = png_get_color_type(image->png_ptr, image->info_ptr);
+    image->bit_depth = png_get_bit_depth(image->png_ptr, image->info_ptr);
+
+    keyed = png_get_tRNS(image->png_ptr, image->info_ptr, &trans_alpha, &num_trans, &trans_color) != 0 &&
+            trans_color != NULL;
+    wide = image->bit_depth == 16;
+    memset(ex->key, 0, sizeof(ex->key));
+    if (keyed) {
+        // Для 8 бит libpng сравнивает только младший байт ключа
+        png_uint_16 mask = wide ? 0xFFFF : 0xFF;
+        ex->key[0] = (image->color_type == PNG_COLOR_TYPE_GRAY ? trans_color->gray : trans_color->red) & mask;
+        ex->key[1] = trans_color->green & mask;
+        ex->key[2] = trans_color->blue & mask;
+    }
+
+    if (image->bit_depth < 8)
+        png_set_packing(image->png_ptr);
+    png_set_interlace_handling(image->png_ptr);
+    png_read_update_info(image->png_ptr, image->info_ptr);
+
+    switch (image->color_type) {
+        case PNG_COLOR_TYPE_PALETTE:
+            build_expand_table(image, ex);
+            ex->expand = expand_indexed;
+            break;
+        case PNG_COLOR_TYPE_GRAY:
+            if (image->bit_depth < 8) {
+                build_expand_table(image, ex);
+                ex->expand = expand_indexed;
+            } else if (keyed) {
+                ex->expand = wide ? expand_gray_key16 : expand_gray_key8;
+            } else {
+                ex->expand = wide ? expand_gray16 : expand_gray8;
+            }
+            break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            ex->expand = wide ? expand_gray_alpha16 : expand_gray_alpha8;
+            break;
+        case PNG_COLOR_TYPE_RGB:
+            if (keyed) {
+                ex->expand = wide ? expand_rgb_key16 : expand_rgb_key8;
+            } else {
+                ex->expand = wide ? expand_rgb16 : expand_rgb8;
+            }
+            break;
+        default:
+            // RGBA 8 бит уже в нужном формате и читается сразу в кадр
+            ex->expand = wide ? expand_rgba16 : NULL;
+            break;
+    }
+
+    ex->rowbytes = png_get_rowbytes(image->png_ptr, image->info_ptr);
+    ex->scratch = NULL;
+    ex->frame = NULL;
+    ex->next_row = 0;
+}
+
+// Готовит буфер для чтения: одну строку или, для чересстрочного PNG, весь кадр в родном формате
+static int begin_native_read(struct Png* image, struct RowExpander* ex) {
     int code = 0;
 
-    if (fp) {
-        fread(header, 1, 8, fp);
-        if (!png_sig_cmp(header, 0, 8)) {
-            image->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-            if (image->png_ptr) {
-                image->info_ptr = png_create_info_struct(image->png_ptr);
-                if (image->info_ptr) {
-                    if (!setjmp(png_jmpbuf(image->png_ptr))) {
-                        png_init_io(image->png_ptr, fp);
-                        png_set_sig_bytes(image->png_ptr, 8);
-                        png_read_info(image->png_ptr, image->info_ptr);
-
-                        image->width = png_get_image_width(image->png_ptr, image->info_ptr);
-                        image->height = png_get_image_height(image->png_ptr, image->info_ptr);
-                        image->color_type = png_get_color_type(image->png_ptr, image->info_ptr);
-                        image->bit_depth = png_get_bit_depth(image->png_ptr, image->info_ptr);
-
-                        if (image->bit_depth == 16)
-                            png_set_strip_16(image->png_ptr);
-                        if (image->color_type == PNG_COLOR_TYPE_PALETTE)
-                            png_set_palette_to_rgb(image->png_ptr);
-                        if (image->color_type == PNG_COLOR_TYPE_GRAY && image->bit_depth < 8)
-                            png_set_expand_gray_1_2_4_to_8(image->png_ptr);
-                        if (png_get_valid(image->png_ptr, image->info_ptr, PNG_INFO_tRNS))
-                            png_set_tRNS_to_alpha(image->png_ptr);
-                        if (!(image->color_type & PNG_COLOR_MASK_ALPHA))
-                            png_set_add_alpha(image->png_ptr, 0xFF, PNG_FILLER_AFTER);
-
-                        png_set_gray_to_rgb(image->png_ptr);
-                        png_read_update_info(image->png_ptr, image->info_ptr);
-
-                        int channels = png_get_channels(image->png_ptr, image->info_ptr);
-                        if (channels == 4) {
-                            png_size_t rowbytes = png_get_rowbytes(image->png_ptr, image->info_ptr);
-                            image->row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image->height);
-                            if (image->row_pointers) {
-                                for (int y = 0; y < image->height && code == 0; y++) {
-                                    image->row_pointers[y] = (png_byte*)malloc(rowbytes);
-                                    if (!image->row_pointers[y]) {
-                                        fprintf(stderr, "Failed to allocate memory for row %d.\n", y);
-                                        for (int i = 0; i < y; i++) free(image->row_pointers[i]);
-                                        free(image->row_pointers);
-                                        image->row_pointers = NULL;
-                                        code = ERR_FILE_IO;
-                                    }
+    if (png_get_interlace_type(image->png_ptr, image->info_ptr) != PNG_INTERLACE_NONE) {
+        png_bytep* rows = (png_bytep*)arena_alloc(image->arena, sizeof(png_bytep) * image->height);
+        ex->frame = (png_bytep)arena_alloc(image->arena, ex->rowbytes * image->height);
+        if (rows && ex->frame) {
+            for (uint32_t y = 0; y < image->height; y++) rows[y] = ex->frame + ex->rowbytes * y;
+            png_read_image(image->png_ptr, rows);
+        } else {
+            code = ERR_FILE_IO;
+        }
+    } else if (ex->expand) {
+        ex->scratch = (png_bytep)arena_alloc(image->arena, ex->rowbytes);
+        if (!ex->scratch) code = ERR_FILE_IO;
+    }
+
+    if (code != 0) fprintf(stderr, "Failed to allocate memory for pixel data.\n");
+    return code;
+}
+
+// Читает следующие count строк сразу в RGBA 8 бит
+static void read_rgba_rows(struct Png* image, struct RowExpander* ex, png_bytep* rows, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (ex->frame) {
+            png_bytep src = ex->frame + ex->rowbytes * (ex->next_row + i);
+            if (ex->expand) ex->expand(rows[i], src, image->width, ex);
+            else memcpy(rows[i], src, ex->rowbytes);
+        } else if (ex->expand) {
+            png_read_row(image->png_ptr, ex->scratch, NULL);
+            ex->expand(rows[i], ex->scratch, image->width, ex);
+        } else {
+            png_read_row(image->png_ptr, rows[i], NULL);
+        }
+    }
+    ex->next_row += count;
+}
+
+struct MemReader {
+    const png_byte* data;
+    size_t size;
+    size_t pos;
+};
+
+// Чтение прямо из отображённого в память файла вместо stdio
+static void png_read_mem(png_structp png_ptr, png_bytep out, png_size_t length) {
+    struct MemReader* reader = (struct MemReader*)png_get_io_ptr(png_ptr);
+    if (length > reader->size - reader->pos) {
+        png_error(png_ptr, "Unexpected end of PNG data");
+    }
+    memcpy(out, reader->data + reader->pos, length);
+    reader->pos += length;
+}
+
+void png_write_outbuf(png_structp png_ptr, png_bytep data, png_size_t length) {
+    outbuf_write((struct OutBuf*)png_get_io_ptr(png_ptr), data, length);
+}
+
+void png_flush_outbuf(png_structp png_ptr) {
+    (void)png_ptr;
+}
+
+// Проверяется сразу после заголовка, до выделения памяти под кадр
+int check_image_limits(struct Png* image, uint64_t frame_bytes, bool can_stream) {
+    int code = 0;
+    uint64_t pixels = (uint64_t)image->width * image->height;
+
+    image->streaming = 0;
+    if (image->max_pixels && pixels > image->max_pixels) {
+        fprintf(stderr, "Image %ux%u exceeds --max-pixels %llu.\n",
+                image->width, image->height, (unsigned long long)image->max_pixels);
+        code = ERR_LIMIT_EXCEEDED;
+    } else if (image->mem_budget && frame_bytes > image->mem_budget) {
+        if (can_stream) {
+            image->streaming = 1;
+        } else {
+            fprintf(stderr, "Image %ux%u needs %llu bytes, more than --mem-budget %llu.\n",
+                    image->width, image->height, (unsigned long long)frame_bytes,
+                    (unsigned long long)image->mem_budget);
+            code = ERR_LIMIT_EXCEEDED;
+        }
+    }
+
+    return code;
+}
+
+// --max-pixels проверяется по IHDR до png_read_info: иначе сторона больше предела
+// отклоняется пользовательскими ограничениями libpng как общая ошибка чтения
+static int check_ihdr_limits(struct Png* image, const png_byte* data, size_t size) {
+    int code = 0;
+
+    if (image->max_pixels && size >= 24 && memcmp(data + 12, "IHDR", 4) == 0) {
+        image->width = png_get_uint_32(data + 16);
+        image->height = png_get_uint_32(data + 20);
+        code = check_image_limits(image, 0, false);
+    }
+
+    return code;
+}
+
+// Ограничения libpng: размеры из IHDR и размер вспомогательных чанков
+static void apply_png_limits(struct Png* image) {
+    if (image->max_pixels) {
+        png_uint_32 limit = image->max_pixels < PNG_UINT_31_MAX ? (png_uint_32)image->max_pixels : PNG_UINT_31_MAX;
+        png_set_user_limits(image->png_ptr, limit, limit);
+    }
+    if (image->mem_budget) {
+        png_set_chunk_malloc_max(image->png_ptr, image->mem_budget);
+    }
+}
+
+// Память под кадр RGBA, а для чересстрочного PNG ещё и под кадр в родном формате
+static uint64_t png_frame_bytes(struct Png* image, const struct RowExpander* ex, bool interlaced) {
+    uint64_t bytes = (uint64_t)image->height * ((uint64_t)image->width * 4 + sizeof(png_bytep));
+    if (interlaced) bytes += (uint64_t)image->height * ex->rowbytes;
+    return bytes;
+}
+
+int read_png_data(const char* name, const png_byte* data, size_t size, struct Png* image) {
+    struct MemReader reader = { data, size, 8 };
+    struct RowExpander expander;
+    int code = 0;
+
+    if (size >= 8 && !png_sig_cmp((png_const_bytep)data, 0, 8)) {
+        code = check_ihdr_limits(image, data, size);
+    } else {
+        fprintf(stderr, "Error: %s is not a valid PNG file.\n", name);
+        code = ERR_FILE_IO;
+    }
+
+    if (code == 0) {
+        image->png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                                  image->scratch, png_arena_malloc, png_arena_free);
+        if (image->png_ptr) {
+            image->info_ptr = png_create_info_struct(image->png_ptr);
+            if (image->info_ptr) {
+                if (!setjmp(png_jmpbuf(image->png_ptr))) {
+                    png_set_read_fn(image->png_ptr, &reader, png_read_mem);
+                    png_set_sig_bytes(image->png_ptr, 8);
+                    apply_png_limits(image);
+                    png_read_info(image->png_ptr, image->info_ptr);
+
+                    setup_native_read(image, &expander);
+
+                    size_t rowbytes = (size_t)image->width * 4;
+                    bool interlaced = png_get_interlace_type(image->png_ptr, image->info_ptr) != PNG_INTERLACE_NONE;
+                    image->channels = 4;
+                    image->input_format = FORMAT_PNG;
+
+                    // Слишком большой кадр не декодируется: его обработает stream_image_rows
+                    code = check_image_limits(image, png_frame_bytes(image, &expander, interlaced), !interlaced);
+                    if (code == 0 && !image->streaming) {
+                        image->row_pointers = (png_bytep*)arena_alloc(image->arena, sizeof(png_bytep) * image->height);
+                        if (image->row_pointers) {
+                            // Все строки лежат в одном непрерывном буфере
+                            image->pixels = (png_bytep)arena_alloc(image->arena, rowbytes * image->height);
+                            if (image->pixels) {
+                                for (uint32_t y = 0; y < image->height; y++) {
+                                    image->row_pointers[y] = image->pixels + rowbytes * y;
                                 }
+                                code = begin_native_read(image, &expander);
                                 if (code == 0) {
-                                    png_read_image(image->png_ptr, image->row_pointers);
+                                    read_rgba_rows(image, &expander, image->row_pointers, image->height);
                                 }
                             } else {
-                                fprintf(stderr, "Failed to allocate memory for row_pointers.\n");
+                                fprintf(stderr, "Failed to allocate memory for pixel data.\n");
+                                image->row_pointers = NULL;
                                 code = ERR_FILE_IO;
                             }
                         } else {
-                            fprintf(stderr, "Expected 4 channels (RGBA), got %d. Aborting.\n", channels);
-                            code = ERR_INVALID_CHANNELS;
+                            fprintf(stderr, "Failed to allocate memory for row_pointers.\n");
+                            code = ERR_FILE_IO;
                         }
-                    } else {
-                        fprintf(stderr, "libpng encountered an error during reading.\n");
-                        code = ERR_FILE_IO;
                     }
                 } else {
-                    fprintf(stderr, "Error in png_create_info_struct\n");
+                    fprintf(stderr, "libpng encountered an error during reading.\n");
                     code = ERR_FILE_IO;
                 }
             } else {
-                fprintf(stderr, "Error in png_create_read_struct\n");
+                fprintf(stderr, "Error in png_create_info_struct\n");
                 code = ERR_FILE_IO;
             }
         } else {
-            fprintf(stderr, "Error: %s is not a valid PNG file.\n", filename);
+            fprintf(stderr, "Error in png_create_read_struct\n");
             code = ERR_FILE_IO;
         }
+    }
 
-        if (code != 0) {
-            if (image->png_ptr && image->info_ptr)
-                png_destroy_read_struct(&image->png_ptr, &image->info_ptr, NULL);
-            else if (image->png_ptr)
-                png_destroy_read_struct(&image->png_ptr, NULL, NULL);
+    // Пиксели уже в памяти, структура чтения больше не нужна; её блоки достанутся кодировщику
+    if (image->png_ptr && image->info_ptr)
+        png_destroy_read_struct(&image->png_ptr, &image->info_ptr, NULL);
+    else if (image->png_ptr)
+        png_destroy_read_struct(&image->png_ptr, NULL, NULL);
+    arena_reset(image->scratch);
+
+    return code;
+}
+
+int read_png_file(const char* filename, struct Png* image) {
+    struct InputMap map;
+    int code = map_input(filename, &map, image->arena);
+
+    if (code == 0) {
+        code = read_png_data(filename, map.data, map.size, image);
+        unmap_input(&map);
+    }
+
+    return code;
+}
+
+// Чтение PNG без кадра в памяти: строки разворачиваются в RGBA по мере запроса
+struct PngRowReader {
+    struct MemReader reader;
+    struct RowExpander expander;
+};
+
+int png_row_reader_open(struct PngRowReader** result, struct Png* image, const png_byte* data, size_t size) {
+    struct PngRowReader* rows = (struct PngRowReader*)arena_calloc(image->arena, 1, sizeof(struct PngRowReader));
+    int code = 0;
+
+    *result = rows;
+    if (!rows) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        code = ERR_FILE_IO;
+    } else {
+        code = check_ihdr_limits(image, data, size);
+    }
+
+    if (code == 0) {
+        rows->reader.data = data;
+        rows->reader.size = size;
+        rows->reader.pos = 8;
+        image->png_ptr = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                                  image->scratch, png_arena_malloc, png_arena_free);
+        if (image->png_ptr) {
+            image->info_ptr = png_create_info_struct(image->png_ptr);
         }
 
-        fclose(fp);
+        if (!image->png_ptr || !image->info_ptr) {
+            fprintf(stderr, "Error creating PNG read structure\n");
+            code = ERR_FILE_IO;
+        } else if (!setjmp(png_jmpbuf(image->png_ptr))) {
+            png_set_read_fn(image->png_ptr, &rows->reader, png_read_mem);
+            png_set_sig_bytes(image->png_ptr, 8);
+            apply_png_limits(image);
+            png_read_info(image->png_ptr, image->info_ptr);
+            setup_native_read(image, &rows->expander);
+
+            // Построчно читается только обычный PNG; чересстрочный требует кадра в родном формате
+            bool interlaced = png_get_interlace_type(image->png_ptr, image->info_ptr) != PNG_INTERLACE_NONE;
+            code = check_image_limits(image, interlaced ? (uint64_t)rows->expander.rowbytes * image->height : 0, false);
+            if (code == 0) code = begin_native_read(image, &rows->expander);
+        } else {
+            fprintf(stderr, "libpng encountered an error during reading.\n");
+            code = ERR_FILE_IO;
+        }
+    }
+
+    return code;
+}
+
+int png_row_reader_read(struct PngRowReader* rows, struct Png* image, png_bytep* out, uint32_t count) {
+    int code = 0;
+
+    if (!setjmp(png_jmpbuf(image->png_ptr))) {
+        read_rgba_rows(image, &rows->expander, out, count);
     } else {
-        fprintf(stderr, "Cannot read file: %s\n", filename);
+        fprintf(stderr, "libpng encountered an error during reading.\n");
         code = ERR_FILE_IO;
     }
 
     return code;
 }
 
+// Закрывается последним, после записи: в scratch-арене больше ничего не живёт
+void png_row_reader_close(struct Png* image) {
+    if (image->png_ptr && image->info_ptr)
+        png_destroy_read_struct(&image->png_ptr, &image->info_ptr, NULL);
+    else if (image->png_ptr)
+        png_destroy_read_struct(&image->png_ptr, NULL, NULL);
+    arena_reset(image->scratch);
+}
+
 int write_png_file(const char *file_name, struct Png *image) {
-    FILE *fp = NULL;
+    struct OutBuf out;
     png_structp write_png_ptr = NULL;
     png_infop write_info_ptr = NULL;
-    int code = 0;
+    int code = outbuf_open(&out, file_name, image->arena);
 
-    fp = fopen(file_name, "wb");
-    if (fp) {
-        write_png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (code == 0) {
+        write_png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                                  image->scratch, png_arena_malloc, png_arena_free);
         if (write_png_ptr) {
             write_info_ptr = png_create_info_struct(write_png_ptr);
             if (write_info_ptr) {
                 if (!setjmp(png_jmpbuf(write_png_ptr))) {
-                    png_init_io(write_png_ptr, fp);
+                    png_set_write_fn(write_png_ptr, &out, png_write_outbuf, png_flush_outbuf);
                     png_set_IHDR(
                         write_png_ptr,
                         write_info_ptr,
@@ -142,9 +515,6 @@ int write_png_file(const char *file_name, struct Png *image) {
             fprintf(stderr, "Error creating PNG write structure\n");
             code = ERR_FILE_IO;
         }
-    } else {
-        fprintf(stderr, "Cannot open file: %s\n", file_name);
-        code = ERR_FILE_IO;
     }
 
     if (write_png_ptr && write_info_ptr) {
@@ -153,7 +523,13 @@ int write_png_file(const char *file_name, struct Png *image) {
         png_destroy_write_struct(&write_png_ptr, NULL);
     }
 
-    if (fp) fclose(fp);
+    if (out.buf) {
+        int close_code = outbuf_close(&out);
+        if (code == 0 && close_code != 0) {
+            fprintf(stderr, "Cannot write file: %s\n", file_name);
+            code = close_code;
+        }
+    }
     return code;
 }
 
@@ -189,151 +565,212 @@ void process_file(struct Png* image) {
                 image->dest_left,
                 image->dest_top
             );
+        } else if (image->flood_mode) {
+            flood_fill(image,
+                image->flood_x,
+                image->flood_y,
+                image->flood_tolerance,
+                (int[]){ image->flood_color.r, image->flood_color.g, image->flood_color.b }
+            );
+        } else if (image->blur_mode != BLUR_NONE) {
+            blur_region(image,
+                image->blur_left,
+                image->blur_top,
+                image->blur_right,
+                image->blur_bottom,
+                image->blur_radius,
+                image->blur_mode
+            );
+        } else if (image->replace_mode) {
+            replace_color(image,
+                (int[]){ image->replace_from.r, image->replace_from.g, image->replace_from.b },
+                (int[]){ image->replace_to.r, image->replace_to.g, image->replace_to.b },
+                image->replace_tolerance
+            );
+        } else if (image->lut_mode) {
+            apply_lut(image, image->lut);
         }
     }
 }
 
+// Сама память кадра принадлежит арене и освобождается вместе с ней
 void free_image(struct Png *image) {
-    if (image->row_pointers != NULL) {
-        for (int y = 0; y < image->height; y++) {
-            if (image->row_pointers[y] != NULL) {
-                free(image->row_pointers[y]);
-            }
+    image->row_pointers = NULL;
+    image->pixels = NULL;
+    unmap_input(&image->source);
+}
+
+// Расширяет диапазон изменённых строк
+static void mark_dirty(struct Png* image, int top, int bottom) {
+    if (!image->dirty) {
+        image->dirty = 1;
+        image->dirty_top = top;
+        image->dirty_bottom = bottom;
+    } else {
+        if (top < image->dirty_top) image->dirty_top = top;
+        if (bottom > image->dirty_bottom) image->dirty_bottom = bottom;
+    }
+}
+
+// Строки, которые сейчас в памяти: весь кадр или полоса при потоковой обработке
+static inline int window_top(const struct Png* image) {
+    return image->band_rows ? image->band_top : 0;
+}
+
+static inline int window_bottom(const struct Png* image) {
+    return image->band_rows ? image->band_top + image->band_rows - 1 : (int)image->height - 1;
+}
+
+// Кадр всегда RGBA 8 бит: пиксель сравнивается и пишется одним 32-битным словом,
+// оба цикла fill_span векторизуются с -O3. Ядра сообщают, изменился ли хоть один пиксель.
+static inline void pack_color(png_bytep out, const int* color) {
+    out[0] = color[0];
+    out[1] = color[1];
+    out[2] = color[2];
+    out[3] = 255;
+}
+
+static bool fill_span(png_bytep row, int x0, int x1, const png_byte* color) {
+    png_bytep px = row + (size_t)x0 * 4;
+    size_t count = (size_t)(x1 - x0 + 1);
+    uint32_t pen, diff = 0;
+
+    memcpy(&pen, color, 4);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t v;
+        memcpy(&v, px + i * 4, 4);
+        diff |= v ^ pen;
+    }
+    if (diff) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(px + i * 4, color, 4);
         }
-        free(image->row_pointers);
-        image->row_pointers = NULL;
     }
+    return diff != 0;
 }
 
-void draw_rectangle(struct Png* image, int x0, int y0, int x1, int y1,
-                    int thickness, int* color, bool fill, int* fill_color) {
-    if (image && image->row_pointers && image->png_ptr && image->info_ptr) {
-        bool valid = true;
-        int width = image->width;
-        int height = image->height;
+static bool copy_span(png_bytep dst, const png_byte* src, int count) {
+    size_t size = (size_t)count * 4;
+    bool changed = memcmp(dst, src, size) != 0;
+    if (changed) memcpy(dst, src, size);
+    return changed;
+}
 
-        if (color[0] < 0 || color[0] > 255 ||
-            color[1] < 0 || color[1] > 255 ||
-            color[2] < 0 || color[2] > 255) {
-            fprintf(stderr, "Invalid border color values. Must be between 0 and 255.\n");
-            image->error_code = ERR_INVALID_COLOR_FORMAT;
-            valid = false;
+// Одна точка цветом, упакованным заранее (один раз на операцию рисования)
+static inline void plot(struct Png* image, int x, int y, const png_byte* color) {
+    int top = window_top(image);
+
+    if (x >= 0 && x < (int)image->width && y >= top && y <= window_bottom(image)) {
+        png_bytep px = image->row_pointers[y - top] + (size_t)x * 4;
+        if (memcmp(px, color, 4) != 0) {
+            memcpy(px, color, 4);
+            mark_dirty(image, y, y);
         }
+    }
+}
 
-        if (x0 >= x1) { int tmp = x0; x0 = x1; x1 = tmp; }
-        if (y0 >= y1) { int tmp = y0; y0 = y1; y1 = tmp; }
+// Заливает прямоугольник с отсечением по границам кадра
+static void fill_rect(struct Png* image, int x0, int y0, int x1, int y1, const png_byte* color) {
+    int top = window_top(image);
+    int bottom = window_bottom(image);
 
-        int t = thickness / 2;
-
-        if (fill) {
-            if (fill_color[0] < 0 || fill_color[0] > 255 ||
-                fill_color[1] < 0 || fill_color[1] > 255 ||
-                fill_color[2] < 0 || fill_color[2] > 255) {
-                fprintf(stderr, "Invalid fill color values. Must be between 0 and 255.\n");
-                image->error_code = ERR_INVALID_COLOR_FORMAT;
-                valid = false;
-            } else if (valid) {
-                for (int y = y0; y <= y1; y++) {
-                    if (y >= 0 && y < height) {
-                        for (int x = x0; x <= x1; x++) {
-                            if (x >= 0 && x < width) {
-                                set_pixel(image, x, y, fill_color);
-                            }
-                        }
-                    }
-                }
+    if (x0 < 0) x0 = 0;
+    if (y0 < top) y0 = top;
+    if (x1 >= (int)image->width) x1 = image->width - 1;
+    if (y1 > bottom) y1 = bottom;
+
+    if (x0 <= x1) {
+        for (int y = y0; y <= y1; y++) {
+            if (fill_span(image->row_pointers[y - top], x0, x1, color)) {
+                mark_dirty(image, y, y);
             }
         }
+    }
+}
 
-        if (valid) {
-            // Верхняя граница
-            for (int y = y0 - t; y <= y0 + t; y++) {
-                if (y >= 0 && y < height) {
-                    for (int x = x0 - t; x <= x1 + t; x++) {
-                        if (x >= 0 && x < width) {
-                            set_pixel(image, x, y, color);
-                        }
-                    }
-                }
-            }
+// Проверка цветов прямоугольника: сообщает обо всех неверных цветах сразу
+static bool rect_colors_valid(struct Png* image, const int* color, bool fill, const int* fill_color) {
+    bool valid = true;
 
-            // Нижняя граница
-            for (int y = y1 - t; y <= y1 + t; y++) {
-                if (y >= 0 && y < height) {
-                    for (int x = x0 - t; x <= x1 + t; x++) {
-                        if (x >= 0 && x < width) {
-                            set_pixel(image, x, y, color);
-                        }
-                    }
-                }
-            }
+    if (color[0] < 0 || color[0] > 255 ||
+        color[1] < 0 || color[1] > 255 ||
+        color[2] < 0 || color[2] > 255) {
+        fprintf(stderr, "Invalid border color values. Must be between 0 and 255.\n");
+        image->error_code = ERR_INVALID_COLOR_FORMAT;
+        valid = false;
+    }
 
-            // Левая граница
-            for (int x = x0 - t; x <= x0 + t; x++) {
-                if (x >= 0 && x < width) {
-                    for (int y = y0; y <= y1; y++) {
-                        if (y >= 0 && y < height) {
-                            set_pixel(image, x, y, color);
-                        }
-                    }
-                }
-            }
+    if (fill && (fill_color[0] < 0 || fill_color[0] > 255 ||
+                 fill_color[1] < 0 || fill_color[1] > 255 ||
+                 fill_color[2] < 0 || fill_color[2] > 255)) {
+        fprintf(stderr, "Invalid fill color values. Must be between 0 and 255.\n");
+        image->error_code = ERR_INVALID_COLOR_FORMAT;
+        valid = false;
+    }
 
-            // Правая граница
-            for (int x = x1 - t; x <= x1 + t; x++) {
-                if (x >= 0 && x < width) {
-                    for (int y = y0; y <= y1; y++) {
-                        if (y >= 0 && y < height) {
-                            set_pixel(image, x, y, color);
-                        }
-                    }
-                }
-            }
+    return valid;
+}
+
+// Заливка (если fill_color не NULL) и граница толщиной 2t+1 вокруг упорядоченных углов
+static void rect_shape(struct Png* image, int x0, int y0, int x1, int y1, int t,
+                       const png_byte* color, const png_byte* fill_color) {
+    if (fill_color) {
+        fill_rect(image, x0, y0, x1, y1, fill_color);
+    }
+    fill_rect(image, x0 - t, y0 - t, x1 + t, y0 + t, color);  // Верхняя граница
+    fill_rect(image, x0 - t, y1 - t, x1 + t, y1 + t, color);  // Нижняя граница
+    fill_rect(image, x0 - t, y0, x0 + t, y1, color);          // Левая граница
+    fill_rect(image, x1 - t, y0, x1 + t, y1, color);          // Правая граница
+}
+
+void draw_rectangle(struct Png* image, int x0, int y0, int x1, int y1,
+                    int thickness, int* color, bool fill, int* fill_color) {
+    if (image && image->row_pointers) {
+        if (x0 >= x1) { int tmp = x0; x0 = x1; x1 = tmp; }
+        if (y0 >= y1) { int tmp = y0; y0 = y1; y1 = tmp; }
+
+        if (rect_colors_valid(image, color, fill, fill_color)) {
+            png_byte pen[4], fill_pen[4];
+            pack_color(pen, color);
+            pack_color(fill_pen, fill_color);
+            rect_shape(image, x0, y0, x1, y1, thickness / 2, pen, fill ? fill_pen : NULL);
         }
     }
 
     return;
 }
+
 void set_pixel(struct Png* image, int x, int y, int* color) {
-    if (image && image->row_pointers && image->png_ptr && image->info_ptr) {
-        if (x >= 0 && x < image->width && y >= 0 && y < image->height) {
-            int channels = png_get_channels(image->png_ptr, image->info_ptr);
-            png_bytep px = &(image->row_pointers[y][x * channels]);
-            px[0] = color[0];
-            px[1] = color[1];
-            px[2] = color[2];
-            if (channels == 4) {
-                px[3] = 255;
-            }
-        }
+    if (image && image->row_pointers) {
+        png_byte packed[4];
+        pack_color(packed, color);
+        plot(image, x, y, packed);
     }
 }
 
-void fill_part(struct Png* image, int x, int x0, int x1, int y, bool fill, int* fill_color) {
+void fill_part(struct Png* image, int x, int x0, int x1, int y, bool fill, const png_byte* fill_color) {
     if (fill) {
         if (x0 > x1) {
             int tmp = x0;
             x0 = x1;
             x1 = tmp;
         }
-        for (int i = x0; i <= x1; i++) {
-            set_pixel(image, i, y, fill_color);
-        }
+        fill_rect(image, x0, y, x1, y, fill_color);
     }
 }
 
-void plot_circle(struct Png* image, int xm, int ym, int thickness, int* color) {
+void plot_circle(struct Png* image, int xm, int ym, int thickness, const png_byte* color) {
     int x0 = xm - thickness/2, x1 = xm + thickness/2, y0 = ym - thickness/2, y1 = ym + thickness/2;
     for (int x = x0; x <= x1; x++) {
         for (int y = y0; y <= y1; y++) {
             if ((x-xm)*(x-xm) + (y-ym)*(y-ym) <= (thickness/2)*(thickness/2)) {
-                set_pixel(image, x, y, color);
+                plot(image, x, y, color);
             }
         }
     }
 }
 
-void draw_line1(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, int* color, bool fill, int* fill_color) {
+void draw_line1(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, const png_byte* color, bool fill, const png_byte* fill_color) {
     int dx = abs(x1 - x0), dy = abs(y1 - y0);
     int d = 2 * dx - dy;
     int incrE = 2 * dx;
@@ -341,7 +778,7 @@ void draw_line1(struct Png* image, int x0, int y0, int x1, int y1, float r, floa
     int x = x0, y = y0;
     while (y <= y1) {
         fill_part(image, x, x0, x1, y, fill, fill_color);
-        set_pixel(image, x, y, color);
+        plot(image, x, y, color);
         if (d <= 0) { d += incrE; y++; }
         else { d += incrNE; x++; y++; }
     }
@@ -353,7 +790,7 @@ void draw_line1(struct Png* image, int x0, int y0, int x1, int y1, float r, floa
     }
 }
 
-void draw_line2(struct Png* image, int x0, int y0, int x1, int y1, float thickness, int* color) {
+void draw_line2(struct Png* image, int x0, int y0, int x1, int y1, float thickness, const png_byte* color) {
     int dx = abs(x1 - x0), dy = abs(y1 - y0);
     int d = 2 * dy - dx;
     int incrE = 2 * dy;
@@ -365,12 +802,12 @@ void draw_line2(struct Png* image, int x0, int y0, int x1, int y1, float thickne
     }
     for (x = x0; x <= x1; x++) {
         for (int y = y0 - thickness/2; y <= y0 + thickness/2; y++) {
-            set_pixel(image, x, y, color);
+            plot(image, x, y, color);
         }
     }
 }
 
-void draw_line3(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, int* color, bool fill, int* fill_color) {
+void draw_line3(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, const png_byte* color, bool fill, const png_byte* fill_color) {
     int dx = abs(x1 - x0), dy = abs(y1 - y0);
     int d = 2 * dx - dy;
     int incrE = 2 * dx;
@@ -378,7 +815,7 @@ void draw_line3(struct Png* image, int x0, int y0, int x1, int y1, float r, floa
     int x = x0, y = y0;
     while (y >= y1) {
         fill_part(image, x, x0, x1, y, fill, fill_color);
-        set_pixel(image, x, y, color);
+        plot(image, x, y, color);
         if (d <= 0) { d += incrE; y--; }
         else { d += incrNE; y--; x++; }
     }
@@ -398,74 +835,91 @@ static bool point_in_hexagon(int x, int y, float cx, float cy, float r) {
            (sqrtf(3.0f) * dx + dy <= sqrtf(3.0f) * r);
 }
 
-void fill_hex(struct Png* image, int x0, int y0, float r, int* fill_color) {
+static void fill_hex(struct Png* image, int x0, int y0, float r, const png_byte* fill_color) {
     float h = r * sqrtf(3) / 2;
     int y_start = (int)floorf(y0 - h);
     int y_end = (int)ceilf(y0 + h);
     int x_start = (int)floorf(x0 - r);
-    int x_end   = (int)ceilf(x0 + r);
 
+    if (y_start < window_top(image)) y_start = window_top(image);
+    if (y_end > window_bottom(image)) y_end = window_bottom(image);
+
+    // Строка шестиугольника симметрична относительно центра: ищем левый край и заливаем отрезок
     for (int y = y_start; y <= y_end; y++) {
-        for (int x = x_start; x <= x_end; x++) {
+        for (int x = x_start; x <= x0; x++) {
             if (point_in_hexagon(x, y, x0, y0, r)) {
-                set_pixel(image, x, y, fill_color);
+                fill_rect(image, x, y, 2 * x0 - x, y, fill_color);
+                break;
             }
         }
     }
 }
 
-void draw_hexagon(struct Png* image, int x0, int y0, float r, float thickness, int* color, bool fill, int* fill_color) {
-    if (image && image->row_pointers && image->png_ptr && image->info_ptr) {
-        if (x0 >= 0 && y0 >= 0 && r >= 0 && thickness >= 0) {
-            if (x0 < image->width && y0 < image->height) {
-                if (color[0] >= 0 && color[0] <= 255 &&
-                    color[1] >= 0 && color[1] <= 255 &&
-                    color[2] >= 0 && color[2] <= 255) {
-
-                    if (!fill || (fill_color[0] >= 0 && fill_color[0] <= 255 &&
-                                  fill_color[1] >= 0 && fill_color[1] <= 255 &&
-                                  fill_color[2] >= 0 && fill_color[2] <= 255)) {
-
-                        int x1 = x0 + r,     y1 = y0;
-                        int x2 = x0 + r / 2, y2 = y0 - r * sqrtf(3) / 2;
-                        int x3 = x0 - r / 2, y3 = y0 - r * sqrtf(3) / 2;
-                        int x4 = x0 - r,     y4 = y0;
-                        int x5 = x0 - r / 2, y5 = y0 + r * sqrtf(3) / 2;
-                        int x6 = x0 + r / 2, y6 = y0 + r * sqrtf(3) / 2;
-
-                        if (fill) {
-                            fill_hex(image, x0, y0, r, fill_color);
-                        }
+// Проверка параметров шестиугольника; сообщения об ошибках идут в stdout
+static bool hexagon_args_valid(struct Png* image, int x0, int y0, float r, float thickness,
+                               const int* color, bool fill, const int* fill_color) {
+    bool valid = false;
 
-                        draw_line2(image, x3, y3, x2, y2, thickness, color); 
-                        draw_line3(image, x4, y4, x3, y3, r, thickness, color, false, fill_color); 
-                        draw_line1(image, x4, y4, x5, y5, r, thickness, color, false, fill_color); 
-                        draw_line2(image, x5, y5, x6, y6, thickness, color); 
-                        draw_line3(image, x6, y6, x1, y1, r, thickness, color, false, fill_color); 
-                        draw_line1(image, x2, y2, x1, y1, r, thickness, color, false, fill_color);
-
-                        plot_circle(image, x1, y1, thickness, color); 
-                        plot_circle(image, x2, y2, thickness, color); 
-                        plot_circle(image, x3, y3, thickness, color); 
-                        plot_circle(image, x4, y4, thickness, color); 
-                        plot_circle(image, x5, y5, thickness, color); 
-                        plot_circle(image, x6, y6, thickness, color);
-                    } else {
-                        printf("Fill color values must be in the range 0–255.\n");
-                        image->error_code = ERR_INVALID_COLOR_FORMAT;
-                    }
+    if (x0 < 0 || y0 < 0 || r < 0 || thickness < 0) {
+        printf("Invalid input: coordinates, radius, and line thickness must not be negative.\n");
+        image->error_code = ERR_INVALID_COORD_FORMAT;
+    } else if (x0 >= image->width || y0 >= image->height) {
+        printf("Invalid input: coordinates are outside the image bounds.\n");
+        image->error_code = ERR_INVALID_COORD_FORMAT;
+    } else if (color[0] < 0 || color[0] > 255 ||
+               color[1] < 0 || color[1] > 255 ||
+               color[2] < 0 || color[2] > 255) {
+        printf("Border color values must be in the range 0–255.\n");
+        image->error_code = ERR_INVALID_COLOR_FORMAT;
+    } else if (fill && (fill_color[0] < 0 || fill_color[0] > 255 ||
+                        fill_color[1] < 0 || fill_color[1] > 255 ||
+                        fill_color[2] < 0 || fill_color[2] > 255)) {
+        printf("Fill color values must be in the range 0–255.\n");
+        image->error_code = ERR_INVALID_COLOR_FORMAT;
+    } else {
+        valid = true;
+    }
 
-                } else {
-                    printf("Border color values must be in the range 0–255.\n");
-                    image->error_code = ERR_INVALID_COLOR_FORMAT;
-                }
-            } else {
-                printf("Invalid input: coordinates are outside the image bounds.\n");
-                image->error_code = ERR_INVALID_COORD_FORMAT;
-            }
-        } else {
-            printf("Invalid input: coordinates, radius, and line thickness must not be negative.\n");
-            image->error_code = ERR_INVALID_COORD_FORMAT;
+    return valid;
+}
+
+// Заливка (если fill_color не NULL), стороны и скруглённые вершины уже упакованными цветами
+static void hexagon_shape(struct Png* image, int x0, int y0, float r, float thickness,
+                          const png_byte* color, const png_byte* fill_color) {
+    int x1 = x0 + r,     y1 = y0;
+    int x2 = x0 + r / 2, y2 = y0 - r * sqrtf(3) / 2;
+    int x3 = x0 - r / 2, y3 = y0 - r * sqrtf(3) / 2;
+    int x4 = x0 - r,     y4 = y0;
+    int x5 = x0 - r / 2, y5 = y0 + r * sqrtf(3) / 2;
+    int x6 = x0 + r / 2, y6 = y0 + r * sqrtf(3) / 2;
+
+    if (fill_color) {
+        fill_hex(image, x0, y0, r, fill_color);
+    }
+
+    draw_line2(image, x3, y3, x2, y2, thickness, color); 
+    draw_line3(image, x4, y4, x3, y3, r, thickness, color, false, NULL); 
+    draw_line1(image, x4, y4, x5, y5, r, thickness, color, false, NULL); 
+    draw_line2(image, x5, y5, x6, y6, thickness, color); 
+    draw_line3(image, x6, y6, x1, y1, r, thickness, color, false, NULL); 
+    draw_line1(image, x2, y2, x1, y1, r, thickness, color, false, NULL);
+
+    plot_circle(image, x1, y1, thickness, color); 
+    plot_circle(image, x2, y2, thickness, color); 
+    plot_circle(image, x3, y3, thickness, color); 
+    plot_circle(image, x4, y4, thickness, color); 
+    plot_circle(image, x5, y5, thickness, color); 
+    plot_circle(image, x6, y6, thickness, color);
+}
+
+void draw_hexagon(struct Png* image, int x0, int y0, float r, float thickness, int* color, bool fill, int* fill_color) {
+    if (image && image->row_pointers) {
+        if (hexagon_args_valid(image, x0, y0, r, thickness, color, fill, fill_color)) {
+            // Цвета упаковываются один раз для всех линий и точек
+            png_byte pen[4], fill_pen[4];
+            pack_color(pen, color);
+            pack_color(fill_pen, fill_color);
+            hexagon_shape(image, x0, y0, r, thickness, pen, fill ? fill_pen : NULL);
         }
     }
 
@@ -477,14 +931,14 @@ void copy_region(struct Png* image,
     int src_right, int src_bottom,
     int dest_left, int dest_top) {
 
-    int width, height, channels, code = 0;
-    png_bytep* buffer = NULL;
+    int width, height, code = 0;
+    const int channels = 4;
+    png_bytep buffer = NULL;
     int copy_width = 0, copy_height = 0;
 
-    if (image && image->row_pointers && image->png_ptr && image->info_ptr) {
+    if (image && image->row_pointers) {
         width = image->width;
         height = image->height;
-        channels = png_get_channels(image->png_ptr, image->info_ptr);
 
         if (src_right < src_left) { int tmp = src_left; src_left = src_right; src_right = tmp; }
         if (src_bottom < src_top) { int tmp = src_top; src_top = src_bottom; src_bottom = tmp; }
@@ -502,50 +956,865 @@ void copy_region(struct Png* image,
             fprintf(stderr, "Copy destination coordinates out of bounds.\n");
             code = ERR_INVALID_COORD_FORMAT;
         } else {
-            buffer = (png_bytep*)malloc(copy_height * sizeof(png_bytep));
+            size_t stride = (size_t)copy_width * channels;
+            buffer = (png_bytep)arena_alloc(image->arena, stride * copy_height);
             if (!buffer) {
                 fprintf(stderr, "Memory allocation failed.\n");
                 code = ERR_FILE_IO;
             } else {
-                for (int y = 0; y < copy_height && code == 0; y++) {
-                    buffer[y] = (png_bytep)malloc(copy_width * channels);
-                    if (!buffer[y]) {
-                        fprintf(stderr, "Memory allocation failed.\n");
-                        code = ERR_FILE_IO;
-                    } else {
-                        memcpy(buffer[y],
-                               &(image->row_pointers[src_top + y][src_left * channels]),
-                               copy_width * channels);
+                for (int y = 0; y < copy_height; y++) {
+                    memcpy(buffer + stride * y,
+                           &(image->row_pointers[src_top + y][src_left * channels]),
+                           stride);
+                }
+
+                int visible = dest_left + copy_width <= width ? copy_width : width - dest_left;
+                for (int y = 0; y < copy_height; y++) {
+                    int dy = dest_top + y;
+                    if (dy >= 0 && dy < height) {
+                        png_bytep dst = &(image->row_pointers[dy][dest_left * channels]);
+                        if (copy_span(dst, buffer + stride * y, visible)) {
+                            mark_dirty(image, dy, dy);
+                        }
                     }
                 }
+            }
+        }
+    }
 
-                if (code == 0) {
-                    for (int y = 0; y < copy_height; y++) {
-                        int dy = dest_top + y;
-                        if (dy >= 0 && dy < height) {
-                            for (int x = 0; x < copy_width; x++) {
-                                int dx = dest_left + x;
-                                if (dx >= 0 && dx < width) {
-                                    memcpy(&(image->row_pointers[dy][dx * channels]),
-                                           &(buffer[y][x * channels]),
-                                           channels);
+    if (image && code != 0) {
+        image->error_code = code;
+    }
+}
+
+#define FLOOD_CHUNK 64
+
+struct FloodStack {
+    struct Arena* arena;
+    int* items;
+    size_t size;
+    size_t capacity;
+};
+
+// Стек растёт удвоением через arena_realloc, без старых копий в арене
+static bool flood_push(struct FloodStack* stack, int x, int y) {
+    bool ok = true;
+    if (stack->size + 2 > stack->capacity) {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 1024;
+        int* items = (int*)arena_realloc(stack->arena, stack->items, capacity * sizeof(int));
+        if (items) {
+            stack->items = items;
+            stack->capacity = capacity;
+        } else {
+            ok = false;
+        }
+    }
+    if (ok) {
+        stack->items[stack->size++] = x;
+        stack->items[stack->size++] = y;
+    }
+    return ok;
+}
+
+// Сравнение без ветвлений: с -O3 цикл векторизуется
+static void flood_match(const png_byte* px, int count, const png_byte* ref, int tolerance, uint8_t* out) {
+    for (int i = 0; i < count; i++) {
+        int dr = abs(px[i * 4 + 0] - ref[0]);
+        int dg = abs(px[i * 4 + 1] - ref[1]);
+        int db = abs(px[i * 4 + 2] - ref[2]);
+        int da = abs(px[i * 4 + 3] - ref[3]);
+        int d = dr > dg ? dr : dg;
+        d = d > db ? d : db;
+        d = d > da ? d : da;
+        out[i] = d <= tolerance;
+    }
+}
+
+static inline bool flood_visited(const uint8_t* visited, size_t bit) {
+    return (visited[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static void flood_mark(uint8_t* visited, size_t from, size_t to) {
+    for (size_t bit = from; bit <= to; bit++) {
+        visited[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+    }
+}
+
+void flood_fill(struct Png* image, int x, int y, int tolerance, int* color) {
+    int code = 0;
+
+    if (image && image->row_pointers) {
+        int width = image->width;
+        int height = image->height;
+
+        if (color[0] < 0 || color[0] > 255 ||
+            color[1] < 0 || color[1] > 255 ||
+            color[2] < 0 || color[2] > 255) {
+            fprintf(stderr, "Invalid fill color values. Must be between 0 and 255.\n");
+            code = ERR_INVALID_COLOR_FORMAT;
+        } else if (tolerance < 0 || tolerance > 255) {
+            fprintf(stderr, "Flood tolerance must be between 0 and 255.\n");
+            code = ERR_INVALID_TOLERANCE;
+        } else if (x < 0 || y < 0 || x >= width || y >= height) {
+            fprintf(stderr, "Flood start point is outside the image bounds.\n");
+            code = ERR_INVALID_COORD_FORMAT;
+        } else {
+            uint8_t* visited = (uint8_t*)arena_calloc(image->arena, ((size_t)width * height + 7) / 8, 1);
+            uint8_t* mask = (uint8_t*)arena_alloc(image->arena, width);
+            struct FloodStack stack = { image->arena, NULL, 0, 0 };
+            png_byte ref[4];
+            png_byte paint[4] = { color[0], color[1], color[2], 255 };
+
+            memcpy(ref, &(image->row_pointers[y][x * 4]), 4);
+
+            if (!visited || !mask || !flood_push(&stack, x, y)) {
+                fprintf(stderr, "Memory allocation failed.\n");
+                code = ERR_FILE_IO;
+            }
+
+            while (code == 0 && stack.size > 0) {
+                int sy = stack.items[--stack.size];
+                int sx = stack.items[--stack.size];
+                png_bytep row = image->row_pointers[sy];
+                size_t base = (size_t)sy * width;
+
+                if (!flood_visited(visited, base + sx)) {
+                    int lx = sx, rx = sx;
+                    bool open = true;
+
+                    // Расширение отрезка влево
+                    while (open && lx > 0) {
+                        int n = lx < FLOOD_CHUNK ? lx : FLOOD_CHUNK;
+                        flood_match(&row[(lx - n) * 4], n, ref, tolerance, mask);
+                        for (int i = n - 1; i >= 0 && open; i--) {
+                            if (mask[i] && !flood_visited(visited, base + lx - 1)) lx--;
+                            else open = false;
+                        }
+                    }
+
+                    // Расширение отрезка вправо
+                    open = true;
+                    while (open && rx < width - 1) {
+                        int n = width - 1 - rx < FLOOD_CHUNK ? width - 1 - rx : FLOOD_CHUNK;
+                        flood_match(&row[(rx + 1) * 4], n, ref, tolerance, mask);
+                        for (int i = 0; i < n && open; i++) {
+                            if (mask[i] && !flood_visited(visited, base + rx + 1)) rx++;
+                            else open = false;
+                        }
+                    }
+
+                    bool changed = false;
+                    for (int i = lx; i <= rx; i++) {
+                        changed |= memcmp(&row[i * 4], paint, 4) != 0;
+                        memcpy(&row[i * 4], paint, 4);
+                    }
+                    if (changed) mark_dirty(image, sy, sy);
+                    flood_mark(visited, base + lx, base + rx);
+
+                    // Поиск новых отрезков в соседних строках
+                    for (int ny = sy - 1; ny <= sy + 1 && code == 0; ny += 2) {
+                        if (ny >= 0 && ny < height) {
+                            size_t nbase = (size_t)ny * width;
+                            bool in_run = false;
+                            flood_match(&(image->row_pointers[ny][lx * 4]), rx - lx + 1, ref, tolerance, mask);
+                            for (int i = 0; i <= rx - lx && code == 0; i++) {
+                                bool ok = mask[i] && !flood_visited(visited, nbase + lx + i);
+                                if (ok && !in_run && !flood_push(&stack, lx + i, ny)) {
+                                    fprintf(stderr, "Memory allocation failed.\n");
+                                    code = ERR_FILE_IO;
                                 }
+                                in_run = ok;
                             }
                         }
                     }
                 }
             }
-        }
 
-        if (buffer) {
-            for (int y = 0; y < copy_height; y++) {
-                if (buffer[y]) free(buffer[y]);
-            }
-            free(buffer);
+            arena_free(image->arena, stack.items);
         }
     }
 
     if (image && code != 0) {
         image->error_code = code;
     }
-}
\ No newline at end of file
+}
+
+
+#define MAX_WORKERS 16
+#define MIN_BAND_SIZE 64
+
+typedef void (*band_fn)(void* ctx, int begin, int end);
+
+struct BandTask {
+    band_fn fn;
+    void* ctx;
+    int begin, end;
+};
+
+static void* band_worker(void* arg) {
+    struct BandTask* task = (struct BandTask*)arg;
+    task->fn(task->ctx, task->begin, task->end);
+    return NULL;
+}
+
+// Делит [0, count) на полосы и обрабатывает их в отдельных потоках
+static void run_bands(int count, band_fn fn, void* ctx) {
+    pthread_t threads[MAX_WORKERS];
+    struct BandTask tasks[MAX_WORKERS];
+    bool started[MAX_WORKERS] = { false };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = count / MIN_BAND_SIZE;
+
+    if (cpus > 0 && workers > cpus) workers = (int)cpus;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    if (workers < 1) workers = 1;
+
+    for (int i = 0; i < workers; i++) {
+        tasks[i].fn = fn;
+        tasks[i].ctx = ctx;
+        tasks[i].begin = (int)((long long)count * i / workers);
+        tasks[i].end = (int)((long long)count * (i + 1) / workers);
+        if (i > 0) {
+            started[i] = pthread_create(&threads[i], NULL, band_worker, &tasks[i]) == 0;
+        }
+    }
+
+    // Полосы, для которых поток не создался, выполняются в текущем потоке
+    for (int i = 0; i < workers; i++) {
+        if (!started[i]) band_worker(&tasks[i]);
+    }
+    for (int i = 1; i < workers; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+struct BlurJob {
+    uint8_t* src;
+    uint8_t* dst;
+    uint32_t* acc;
+    int width, height;
+    int radius;
+};
+
+// Горизонтальный проход: скользящая сумма по строке, стоимость не зависит от радиуса
+static void blur_rows(void* ctx, int begin, int end) {
+    struct BlurJob* job = (struct BlurJob*)ctx;
+    int w = job->width, r = job->radius;
+    float inv = 1.0f / (2 * r + 1);
+
+    for (int y = begin; y < end; y++) {
+        const uint8_t* in = job->src + (size_t)y * w * 4;
+        uint8_t* out = job->dst + (size_t)y * w * 4;
+        uint32_t acc[4];
+
+        for (int c = 0; c < 4; c++) acc[c] = (uint32_t)(r + 1) * in[c];
+        for (int i = 1; i <= r; i++) {
+            const uint8_t* px = &in[(i < w ? i : w - 1) * 4];
+            for (int c = 0; c < 4; c++) acc[c] += px[c];
+        }
+
+        for (int x = 0; x < w; x++) {
+            const uint8_t* add = &in[(x + r + 1 < w ? x + r + 1 : w - 1) * 4];
+            const uint8_t* sub = &in[(x - r > 0 ? x - r : 0) * 4];
+            for (int c = 0; c < 4; c++) {
+                out[x * 4 + c] = (uint8_t)(acc[c] * inv + 0.5f);
+                acc[c] += add[c] - sub[c];
+            }
+        }
+    }
+}
+
+// Вертикальный проход: полоса столбцов, суммы по всей ширине полосы обновляются одним циклом
+static void blur_cols(void* ctx, int begin, int end) {
+    struct BlurJob* job = (struct BlurJob*)ctx;
+    int h = job->height, r = job->radius;
+    size_t stride = (size_t)job->width * 4;
+    size_t offset = (size_t)begin * 4;
+    int n = (end - begin) * 4;
+    float inv = 1.0f / (2 * r + 1);
+    uint32_t* acc = job->acc + offset;
+
+    const uint8_t* first = job->src + offset;
+    for (int i = 0; i < n; i++) acc[i] = (uint32_t)(r + 1) * first[i];
+    for (int k = 1; k <= r; k++) {
+        const uint8_t* row = job->src + (size_t)(k < h ? k : h - 1) * stride + offset;
+        for (int i = 0; i < n; i++) acc[i] += row[i];
+    }
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t* add = job->src + (size_t)(y + r + 1 < h ? y + r + 1 : h - 1) * stride + offset;
+        const uint8_t* sub = job->src + (size_t)(y - r > 0 ? y - r : 0) * stride + offset;
+        uint8_t* out = job->dst + (size_t)y * stride + offset;
+        for (int i = 0; i < n; i++) {
+            out[i] = (uint8_t)(acc[i] * inv + 0.5f);
+            acc[i] += add[i] - sub[i];
+        }
+    }
+}
+
+// Три box-прохода с радиусами, приближающими гауссиану с sigma = radius
+static int gauss_box_radii(float sigma, int* radii) {
+    float ideal = sqrtf(12.0f * sigma * sigma / 3 + 1);
+    int wl = (int)floorf(ideal);
+    if (wl % 2 == 0) wl--;
+    int wu = wl + 2;
+    int m = (int)roundf((12.0f * sigma * sigma - 3 * wl * wl - 12 * wl - 9) / (-4.0f * wl - 4));
+
+    for (int i = 0; i < 3; i++) {
+        radii[i] = ((i < m ? wl : wu) - 1) / 2;
+    }
+    return 3;
+}
+
+// Радиусы box-проходов; строка результата зависит от входа не дальше суммы радиусов
+static int blur_passes(int radius, int mode, int* radii) {
+    radii[0] = radii[1] = radii[2] = radius;
+    return mode == BLUR_GAUSS ? gauss_box_radii((float)radius, radii) : 1;
+}
+
+// Упорядочивает углы области размытия и проверяет её и радиус
+static bool blur_args_valid(struct Png* image, int* left, int* top, int* right, int* bottom, int radius) {
+    bool valid = false;
+
+    if (*right < *left) { int tmp = *left; *left = *right; *right = tmp; }
+    if (*bottom < *top) { int tmp = *top; *top = *bottom; *bottom = tmp; }
+
+    if (*right - *left <= 0 || *bottom - *top <= 0) {
+        fprintf(stderr, "Blur region has non-positive size.\n");
+        image->error_code = ERR_INVALID_COORD_FORMAT;
+    } else if (*left < 0 || *top < 0 || *right > (int)image->width || *bottom > (int)image->height) {
+        fprintf(stderr, "Blur region coordinates out of bounds.\n");
+        image->error_code = ERR_INVALID_COORD_FORMAT;
+    } else if (radius <= 0) {
+        fprintf(stderr, "Blur radius must be positive.\n");
+        image->error_code = ERR_INVALID_BLUR_ARGS;
+    } else {
+        valid = true;
+    }
+
+    return valid;
+}
+
+// Размывает w x h пикселей в a; b и acc — рабочие буферы того же размера и на w * 4 сумм.
+// Края области продолжаются крайними строками и столбцами.
+static void blur_pixels(uint8_t* a, uint8_t* b, uint32_t* acc, int w, int h, const int* radii, int passes) {
+    for (int p = 0; p < passes; p++) {
+        if (radii[p] > 0) {
+            struct BlurJob horizontal = { a, b, acc, w, h, radii[p] };
+            struct BlurJob vertical = { b, a, acc, w, h, radii[p] };
+            run_bands(h, blur_rows, &horizontal);
+            run_bands(w, blur_cols, &vertical);
+        }
+    }
+}
+
+void blur_region(struct Png* image, int left, int top, int right, int bottom, int radius, int mode) {
+    if (image && image->row_pointers && blur_args_valid(image, &left, &top, &right, &bottom, radius)) {
+        int w = right - left;
+        int h = bottom - top;
+        size_t size = (size_t)w * h * 4;
+        uint8_t* a = (uint8_t*)arena_alloc(image->arena, size);
+        uint8_t* b = (uint8_t*)arena_alloc(image->arena, size);
+        // Суммы для вертикального прохода: у каждой полосы столбцов свой участок
+        uint32_t* acc = (uint32_t*)arena_alloc(image->arena, (size_t)w * 4 * sizeof(uint32_t));
+
+        if (a && b && acc) {
+            int radii[3];
+            int passes = blur_passes(radius, mode, radii);
+
+            for (int y = 0; y < h; y++) {
+                memcpy(a + (size_t)y * w * 4, &(image->row_pointers[top + y][left * 4]), (size_t)w * 4);
+            }
+
+            blur_pixels(a, b, acc, w, h, radii, passes);
+
+            for (int y = 0; y < h; y++) {
+                png_bytep dst = &(image->row_pointers[top + y][left * 4]);
+                if (memcmp(dst, a + (size_t)y * w * 4, (size_t)w * 4) != 0) {
+                    memcpy(dst, a + (size_t)y * w * 4, (size_t)w * 4);
+                    mark_dirty(image, top + y, top + y);
+                }
+            }
+        } else {
+            fprintf(stderr, "Memory allocation failed.\n");
+            image->error_code = ERR_FILE_IO;
+        }
+    }
+}
+
+
+// Маска вместо ветвления: с -O3 цикл по непрерывному буферу векторизуется
+static bool replace_kernel(png_bytep px, size_t count, const uint8_t* from, const uint8_t* to, int tolerance) {
+    uint8_t changed = 0;
+    for (size_t i = 0; i < count; i++) {
+        png_bytep p = px + i * 4;
+        int dr = abs(p[0] - from[0]);
+        int dg = abs(p[1] - from[1]);
+        int db = abs(p[2] - from[2]);
+        int d = dr > dg ? dr : dg;
+        d = d > db ? d : db;
+        uint8_t m = (uint8_t)-(d <= tolerance);
+        changed |= ((p[0] ^ to[0]) | (p[1] ^ to[1]) | (p[2] ^ to[2])) & m;
+        p[0] = (to[0] & m) | (p[0] & ~m);
+        p[1] = (to[1] & m) | (p[1] & ~m);
+        p[2] = (to[2] & m) | (p[2] & ~m);
+    }
+    return changed != 0;
+}
+
+static bool replace_args_valid(struct Png* image, const int* from, const int* to, int tolerance) {
+    bool valid = false;
+
+    if (from[0] < 0 || from[0] > 255 || from[1] < 0 || from[1] > 255 || from[2] < 0 || from[2] > 255 ||
+        to[0] < 0 || to[0] > 255 || to[1] < 0 || to[1] > 255 || to[2] < 0 || to[2] > 255) {
+        fprintf(stderr, "Invalid replacement color values. Must be between 0 and 255.\n");
+        image->error_code = ERR_INVALID_COLOR_FORMAT;
+    } else if (tolerance < 0 || tolerance > 255) {
+        fprintf(stderr, "Replacement tolerance must be between 0 and 255.\n");
+        image->error_code = ERR_INVALID_TOLERANCE;
+    } else {
+        valid = true;
+    }
+
+    return valid;
+}
+
+static void replace_rows(struct Png* image, const uint8_t* from, const uint8_t* to, int tolerance) {
+    int top = window_top(image);
+    int bottom = window_bottom(image);
+
+    for (int y = top; y <= bottom; y++) {
+        if (replace_kernel(image->row_pointers[y - top], image->width, from, to, tolerance)) {
+            mark_dirty(image, y, y);
+        }
+    }
+}
+
+void replace_color(struct Png* image, int* from, int* to, int tolerance) {
+    if (image && image->row_pointers && replace_args_valid(image, from, to, tolerance)) {
+        uint8_t f[3] = { from[0], from[1], from[2] };
+        uint8_t t[3] = { to[0], to[1], to[2] };
+        replace_rows(image, f, t, tolerance);
+    }
+}
+
+void apply_lut(struct Png* image, uint8_t lut[3][256]) {
+    if (image && image->row_pointers) {
+        int top = window_top(image);
+        int bottom = window_bottom(image);
+
+        for (int y = top; y <= bottom; y++) {
+            png_bytep px = image->row_pointers[y - top];
+            uint8_t changed = 0;
+            for (uint32_t i = 0; i < image->width; i++) {
+                uint8_t r = lut[0][px[i * 4 + 0]];
+                uint8_t g = lut[1][px[i * 4 + 1]];
+                uint8_t b = lut[2][px[i * 4 + 2]];
+                changed |= (r ^ px[i * 4 + 0]) | (g ^ px[i * 4 + 1]) | (b ^ px[i * 4 + 2]);
+                px[i * 4 + 0] = r;
+                px[i * 4 + 1] = g;
+                px[i * 4 + 2] = b;
+            }
+            if (changed) mark_dirty(image, y, y);
+        }
+    }
+}
+
+#define STREAM_BAND_MAX 256
+
+// Операция над полосой: параметры проверены, а цвета упакованы один раз до первой полосы
+struct BandJob {
+    png_byte pen[4];
+    png_byte fill_pen[4];
+    bool fill;
+    int x0, y0, x1, y1;         // упорядоченные углы прямоугольника или области размытия
+    uint8_t from[3], to[3];
+    int top, bottom;            // строки, которые операция может изменить
+    bool blur;
+    int radii[3], passes;
+    uint32_t margin;            // строки окна над и под полосой, нужные размытию
+    uint8_t *a, *b;             // буферы blur_pixels на всё окно
+    uint32_t* acc;
+    png_bytep* out;             // размытая полоса: окно остаётся нетронутым для следующей
+};
+
+static int prepare_band_job(struct Png* image, struct BandJob* job) {
+    memset(job, 0, sizeof(*job));
+    job->top = 0;
+    job->bottom = (int)image->height - 1;
+
+    if (image->draw_hexagon) {
+        int color[3] = { image->hex_border_color.r, image->hex_border_color.g, image->hex_border_color.b };
+        int fill_color[3] = { image->hex_fill_color.r, image->hex_fill_color.g, image->hex_fill_color.b };
+        if (hexagon_args_valid(image, image->hex_center_x, image->hex_center_y, image->hex_radius,
+                               image->hex_thickness, color, image->hex_fill, fill_color)) {
+            // Стороны и вершины выходят за описанный прямоугольник не больше чем на толщину
+            int reach = (int)ceilf(image->hex_radius * sqrtf(3) / 2 + image->hex_thickness) + 1;
+            pack_color(job->pen, color);
+            pack_color(job->fill_pen, fill_color);
+            job->fill = image->hex_fill;
+            job->top = image->hex_center_y - reach;
+            job->bottom = image->hex_center_y + reach;
+        }
+    } else if (image->draw_rectangle) {
+        int color[3] = { image->rect_border_color.r, image->rect_border_color.g, image->rect_border_color.b };
+        int fill_color[3] = { image->rect_fill_color.r, image->rect_fill_color.g, image->rect_fill_color.b };
+        int t = image->rect_thickness / 2;
+        job->x0 = image->rect_left < image->rect_right ? image->rect_left : image->rect_right;
+        job->x1 = image->rect_left < image->rect_right ? image->rect_right : image->rect_left;
+        job->y0 = image->rect_up < image->rect_down ? image->rect_up : image->rect_down;
+        job->y1 = image->rect_up < image->rect_down ? image->rect_down : image->rect_up;
+        if (rect_colors_valid(image, color, image->rect_fill, fill_color)) {
+            pack_color(job->pen, color);
+            pack_color(job->fill_pen, fill_color);
+            job->fill = image->rect_fill;
+            job->top = job->y0 - t;
+            job->bottom = job->y1 + t;
+        }
+    } else if (image->replace_mode) {
+        int from[3] = { image->replace_from.r, image->replace_from.g, image->replace_from.b };
+        int to[3] = { image->replace_to.r, image->replace_to.g, image->replace_to.b };
+        if (replace_args_valid(image, from, to, image->replace_tolerance)) {
+            for (int c = 0; c < 3; c++) {
+                job->from[c] = from[c];
+                job->to[c] = to[c];
+            }
+        }
+    } else if (image->blur_mode != BLUR_NONE) {
+        int left = image->blur_left, top = image->blur_top;
+        int right = image->blur_right, bottom = image->blur_bottom;
+        if (blur_args_valid(image, &left, &top, &right, &bottom, image->blur_radius)) {
+            job->blur = true;
+            job->x0 = left;
+            job->y0 = top;
+            job->x1 = right;
+            job->y1 = bottom;
+            job->top = top;
+            job->bottom = bottom - 1;
+            job->passes = blur_passes(image->blur_radius, image->blur_mode, job->radii);
+            for (int p = 0; p < job->passes; p++) {
+                job->margin += job->radii[p];
+            }
+        }
+    } else if (image->copy_mode || image->flood_mode) {
+        fprintf(stderr, "Error: image exceeds --mem-budget; --copy and --flood need the whole image in memory.\n");
+        image->error_code = ERR_LIMIT_EXCEEDED;
+    }
+
+    return image->error_code;
+}
+
+static void process_band(struct Png* image, const struct BandJob* job) {
+    if (window_bottom(image) >= job->top && window_top(image) <= job->bottom) {
+        if (image->draw_hexagon) {
+            hexagon_shape(image, image->hex_center_x, image->hex_center_y, image->hex_radius,
+                          image->hex_thickness, job->pen, job->fill ? job->fill_pen : NULL);
+        } else if (image->draw_rectangle) {
+            rect_shape(image, job->x0, job->y0, job->x1, job->y1, image->rect_thickness / 2,
+                       job->pen, job->fill ? job->fill_pen : NULL);
+        } else if (image->replace_mode) {
+            replace_rows(image, job->from, job->to, image->replace_tolerance);
+        } else if (image->lut_mode) {
+            apply_lut(image, image->lut);
+        }
+    }
+}
+
+// Размытие строк полосы [top, top + count): источник — всё окно, результат пишется в job->out.
+// Окно шире полосы на job->margin строк с каждой стороны, поэтому строки полосы совпадают
+// с размытием целого кадра: ошибка от обрезанного края уходит не дальше суммы радиусов.
+static void blur_band(struct Png* image, const struct BandJob* job, int top, int count) {
+    int wtop = window_top(image);
+    size_t rowbytes = (size_t)image->width * 4;
+    int first = job->y0 > wtop ? job->y0 : wtop;
+    int last = job->y1 < window_bottom(image) + 1 ? job->y1 : window_bottom(image) + 1;
+    int from = job->top > top ? job->top : top;
+    int to = job->bottom < top + count - 1 ? job->bottom : top + count - 1;
+
+    for (int i = 0; i < count; i++) {
+        memcpy(job->out[i], image->row_pointers[top + i - wtop], rowbytes);
+    }
+    if (from <= to) {
+        int w = job->x1 - job->x0;
+        int h = last - first;
+
+        for (int y = 0; y < h; y++) {
+            memcpy(job->a + (size_t)y * w * 4, &(image->row_pointers[first + y - wtop][job->x0 * 4]), (size_t)w * 4);
+        }
+        blur_pixels(job->a, job->b, job->acc, w, h, job->radii, job->passes);
+        for (int y = from; y <= to; y++) {
+            memcpy(&(job->out[y - top][job->x0 * 4]), job->a + (size_t)(y - first) * w * 4, (size_t)w * 4);
+        }
+    }
+}
+
+// Циклический сдвиг указателей окна на drop строк: буферы ушедших строк переходят в конец
+static void rotate_rows(png_bytep* rows, uint32_t count, uint32_t drop) {
+    uint32_t spans[3][2] = { { 0, drop }, { drop, count }, { 0, count } };
+
+    for (int s = 0; s < 3; s++) {
+        for (uint32_t i = spans[s][0], j = spans[s][1]; i + 1 < j; i++, j--) {
+            png_bytep tmp = rows[i];
+            rows[i] = rows[j - 1];
+            rows[j - 1] = tmp;
+        }
+    }
+}
+
+// Полоса не больше STREAM_BAND_MAX строк и четверти --mem-budget
+static uint32_t stream_band_rows(const struct Png* image) {
+    uint64_t rows = image->mem_budget / 4 / ((uint64_t)image->width * 4 + sizeof(png_bytep));
+
+    if (rows > STREAM_BAND_MAX) rows = STREAM_BAND_MAX;
+    if (rows > image->height) rows = image->height;
+    if (rows < 1) rows = 1;
+    return (uint32_t)rows;
+}
+
+// Буфер из count строк по rowbytes байт
+static png_bytep* alloc_rows(struct Arena* arena, uint32_t count, size_t rowbytes) {
+    png_bytep* rows = (png_bytep*)arena_alloc(arena, sizeof(png_bytep) * count);
+    png_bytep pixels = (png_bytep)arena_alloc(arena, rowbytes * count);
+
+    if (rows && pixels) {
+        for (uint32_t i = 0; i < count; i++) rows[i] = pixels + rowbytes * i;
+    }
+    return rows && pixels ? rows : NULL;
+}
+
+// Обработка без загрузки кадра: вход декодируется полосами строк, каждая полоса
+// обрабатывается и сразу кодируется. Для --blur в окне держится ещё job.margin строк
+// над и под полосой, поэтому окно может выйти за --mem-budget на несколько радиусов.
+// --copy и --flood отклоняются с ERR_LIMIT_EXCEEDED.
+int stream_image_rows(struct Png* image, const char* filename, int format) {
+    struct BandJob job;
+    struct RowReader* reader = NULL;
+    struct RowWriter* writer = NULL;
+    png_bytep* rows = NULL;
+    uint32_t band = 0, window = 0;
+    int code = prepare_band_job(image, &job);
+
+    if (code == 0) {
+        code = row_reader_open(&reader, image, image->source.data, image->source.size);
+    }
+    if (code == 0) {
+        size_t rowbytes = (size_t)image->width * 4;
+
+        band = stream_band_rows(image);
+        if (job.blur && band < 2 * (uint64_t)job.margin) {
+            // Окно всё равно не меньше 2 * margin строк: с такой полосой каждая строка
+            // размывается не больше двух раз
+            band = 2 * (uint64_t)job.margin < image->height ? 2 * job.margin : image->height;
+        }
+        window = (uint64_t)band + 2 * (uint64_t)job.margin < image->height ? band + 2 * job.margin : image->height;
+        rows = alloc_rows(image->arena, window, rowbytes);
+        if (rows && job.blur) {
+            int w = job.x1 - job.x0;
+            int h = job.y1 - job.y0 < (int)window ? job.y1 - job.y0 : (int)window;
+            job.out = alloc_rows(image->arena, band, rowbytes);
+            job.a = (uint8_t*)arena_alloc(image->arena, (size_t)w * h * 4);
+            job.b = (uint8_t*)arena_alloc(image->arena, (size_t)w * h * 4);
+            job.acc = (uint32_t*)arena_alloc(image->arena, (size_t)w * 4 * sizeof(uint32_t));
+        }
+        if (!rows || (job.blur && !(job.out && job.a && job.b && job.acc))) {
+            fprintf(stderr, "Failed to allocate memory for pixel data.\n");
+            code = ERR_FILE_IO;
+        }
+    }
+    if (code == 0) {
+        code = row_writer_open(&writer, filename, image, format);
+    }
+
+    // Окно — строки [band_top, band_top + band_rows) входа, полоса лежит внутри него
+    image->row_pointers = rows;
+    image->band_top = 0;
+    image->band_rows = 0;
+    for (uint32_t top = 0; top < image->height && code == 0; top += band) {
+        uint32_t count = image->height - top < band ? image->height - top : band;
+        uint32_t first = top > job.margin ? top - job.margin : 0;
+        uint32_t last = image->height - top - count > job.margin ? top + count + job.margin : image->height;
+        png_bytep* out = NULL;
+
+        if (first > (uint32_t)image->band_top) {
+            rotate_rows(rows, window, first - image->band_top);
+            image->band_rows -= first - image->band_top;
+            image->band_top = first;
+        }
+        if (last > image->band_top + image->band_rows) {
+            code = row_reader_read(reader, rows + image->band_rows, last - image->band_top - image->band_rows);
+            image->band_rows = last - image->band_top;
+        }
+        if (code == 0 && job.blur) {
+            blur_band(image, &job, top, count);
+            out = job.out;
+        } else if (code == 0) {
+            process_band(image, &job);
+            out = rows + (top - image->band_top);
+        }
+        for (uint32_t i = 0; i < count && code == 0; i++) {
+            code = row_writer_write(writer, out[i]);
+        }
+    }
+
+    if (writer) {
+        int close_code = row_writer_close(writer, filename);
+        if (code == 0) code = close_code;
+    }
+    row_reader_close(reader);
+
+    image->row_pointers = NULL;
+    image->band_rows = 0;
+    return code;
+}
+
+int load_lut(const char* filename, uint8_t lut[3][256]) {
+    FILE* fp = fopen(filename, "r");
+    int code = 0;
+
+    if (fp) {
+        for (int i = 0; i < 256 && code == 0; i++) {
+            int r, g, b;
+            if (fscanf(fp, "%d %d %d", &r, &g, &b) != 3 ||
+                r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+                fprintf(stderr, "Invalid LUT entry %d in %s. Expected 256 lines of R G B.\n", i, filename);
+                code = ERR_INVALID_LUT;
+            } else {
+                lut[0][i] = r;
+                lut[1][i] = g;
+                lut[2][i] = b;
+            }
+        }
+        fclose(fp);
+    } else {
+        fprintf(stderr, "Cannot read file: %s\n", filename);
+        code = ERR_FILE_IO;
+    }
+
+    return code;
+}
+
+
+#define STATS_CHUNK_BYTES (8 << 20)
+
+struct StatsJob {
+    png_bytep* rows;
+    uint32_t width;
+    struct PixelStats* total;
+    pthread_mutex_t lock;
+};
+
+static void stats_reset(struct PixelStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int c = 0; c < 4; c++) stats->min[c] = 255;
+}
+
+static void stats_merge(struct PixelStats* dst, const struct PixelStats* src) {
+    for (int c = 0; c < 4; c++) {
+        for (int v = 0; v < 256; v++) dst->histogram[c][v] += src->histogram[c][v];
+        dst->sum[c] += src->sum[c];
+        if (src->min[c] < dst->min[c]) dst->min[c] = src->min[c];
+        if (src->max[c] > dst->max[c]) dst->max[c] = src->max[c];
+    }
+    dst->pixels += src->pixels;
+}
+
+// Полоса строк считается в локальную структуру и один раз сливается в общую
+static void stats_rows(void* ctx, int begin, int end) {
+    struct StatsJob* job = (struct StatsJob*)ctx;
+    struct PixelStats local;
+    stats_reset(&local);
+
+    for (int y = begin; y < end; y++) {
+        const png_byte* px = job->rows[y];
+        uint32_t sum[4] = { 0, 0, 0, 0 };
+        uint8_t lo[4] = { 255, 255, 255, 255 };
+        uint8_t hi[4] = { 0, 0, 0, 0 };
+
+        // Суммы, минимумы и максимумы по каналам без ветвлений
+        for (uint32_t x = 0; x < job->width; x++) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t v = px[x * 4 + c];
+                sum[c] += v;
+                lo[c] = v < lo[c] ? v : lo[c];
+                hi[c] = v > hi[c] ? v : hi[c];
+            }
+        }
+        for (uint32_t x = 0; x < job->width; x++) {
+            local.histogram[0][px[x * 4 + 0]]++;
+            local.histogram[1][px[x * 4 + 1]]++;
+            local.histogram[2][px[x * 4 + 2]]++;
+            local.histogram[3][px[x * 4 + 3]]++;
+        }
+        for (int c = 0; c < 4; c++) {
+            local.sum[c] += sum[c];
+            if (lo[c] < local.min[c]) local.min[c] = lo[c];
+            if (hi[c] > local.max[c]) local.max[c] = hi[c];
+        }
+        local.pixels += job->width;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    stats_merge(job->total, &local);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void stats_collect(png_bytep* rows, uint32_t width, int count, struct PixelStats* stats) {
+    struct StatsJob job;
+    job.rows = rows;
+    job.width = width;
+    job.total = stats;
+    pthread_mutex_init(&job.lock, NULL);
+    run_bands(count, stats_rows, &job);
+    pthread_mutex_destroy(&job.lock);
+}
+
+// Один проход по строкам кусками фиксированного размера (не больше бюджета): память не
+// зависит от размера изображения; чересстрочный PNG целиком читается в png_row_reader_open
+int read_png_stats(const char* filename, struct Png* image, struct PixelStats* stats) {
+    struct InputMap map;
+    struct RowReader* reader = NULL;
+    int format = FORMAT_UNKNOWN;
+    int code = 0;
+
+    stats_reset(stats);
+    code = map_input(filename, &map, image->arena);
+
+    if (code == 0) {
+        format = detect_format(map.data, map.size);
+        if (format == FORMAT_UNKNOWN) {
+            fprintf(stderr, "Error: %s is not a PNG, PPM, PAM or QOI file.\n", filename);
+            code = ERR_FILE_IO;
+        } else {
+            code = row_reader_open(&reader, image, map.data, map.size);
+        }
+
+        if (code == 0) {
+            size_t rowbytes = (size_t)image->width * 4;
+            size_t chunk_bytes = STATS_CHUNK_BYTES;
+            if (image->mem_budget && image->mem_budget < chunk_bytes) chunk_bytes = image->mem_budget;
+            uint32_t chunk_rows = chunk_bytes / rowbytes;
+            if (chunk_rows < 1) chunk_rows = 1;
+            if (chunk_rows > image->height) chunk_rows = image->height;
+
+            png_bytep chunk = (png_bytep)arena_alloc(image->arena, rowbytes * chunk_rows);
+            png_bytep* rows = (png_bytep*)arena_alloc(image->arena, sizeof(png_bytep) * chunk_rows);
+            if (chunk && rows) {
+                for (uint32_t i = 0; i < chunk_rows; i++) rows[i] = chunk + rowbytes * i;
+                for (uint32_t y = 0; y < image->height && code == 0; y += chunk_rows) {
+                    uint32_t count = image->height - y < chunk_rows ? image->height - y : chunk_rows;
+                    code = row_reader_read(reader, rows, count);
+                    if (code == 0) stats_collect(rows, image->width, count, stats);
+                }
+            } else {
+                fprintf(stderr, "Memory allocation failed.\n");
+                code = ERR_FILE_IO;
+            }
+        }
+
+        row_reader_close(reader);
+        if (code == 0) image->input_format = format;
+        unmap_input(&map);
+    }
+
+    return code;
+}
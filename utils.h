@@ -20,7 +20,33 @@ enum OptionFlags {
     OPT_COPY,
     OPT_DEST_LEFT_UP = 1011,
     OPT_THICKNESS,
-    OPT_INPUT
+    OPT_INPUT,
+    OPT_FLOOD,
+    OPT_TOLERANCE,
+    OPT_BLUR,
+    OPT_BLUR_MODE,
+    OPT_REPLACE_COLOR,
+    OPT_LUT,
+    OPT_STATS_PIXELS,
+    OPT_FORMAT,
+    OPT_CACHE,
+    OPT_MAX_PIXELS,
+    OPT_MEM_BUDGET,
+    OPT_REPLACE_TO
+};
+
+enum ImageFormats {
+    FORMAT_PNG = 0,
+    FORMAT_PPM,
+    FORMAT_PAM,
+    FORMAT_QOI,
+    FORMAT_UNKNOWN
+};
+
+enum BlurModes {
+    BLUR_NONE = 0,
+    BLUR_BOX,
+    BLUR_GAUSS
 };
 
 enum ErrorCodes {
@@ -33,12 +59,65 @@ enum ErrorCodes {
     ERR_UNKNOWN_OPTION,             
     ERR_INVALID_THICKNESS,          
     ERR_FILE_IO,                    
-    ERR_INVALID_CHANNELS            
+    ERR_INVALID_CHANNELS,
+    ERR_INVALID_TOLERANCE,
+    ERR_INVALID_LUT,
+    ERR_INVALID_FORMAT,
+    ERR_LIMIT_EXCEEDED,
+    ERR_INVALID_BLUR_ARGS
 };
 struct Color {
     uint8_t r, g, b;
 };
 
+// Арена: вся память одного задания, освобождается целиком.
+// Куски из arena_malloc можно вернуть по одному: мелкие ждут повторной выдачи в списках
+// по размеру, крупные (больше половины блока) сразу отдаются системе.
+#define ARENA_CLASSES 48
+
+struct ArenaBlock;
+struct ArenaLarge;
+
+struct Arena {
+    struct ArenaBlock* first;
+    struct ArenaBlock* current;
+    size_t block_size;
+    void* free_lists[ARENA_CLASSES];
+    struct ArenaLarge* large;
+};
+
+// Входной файл, отображённый в память (или прочитанный из stdin в кусок арены)
+struct InputMap {
+    png_bytep data;
+    size_t size;
+    int mapped;
+    struct Arena* arena;
+};
+
+// Выходной буфер, сбрасываемый крупными блоками через write()
+struct OutBuf {
+    int fd;
+    png_bytep buf;
+    size_t size;
+    size_t capacity;
+    int error;
+};
+
+// Построчная запись изображения в любом из выходных форматов
+struct RowWriter;
+
+// Построчное чтение входа (и отдельно PNG, без кадра в памяти)
+struct RowReader;
+struct PngRowReader;
+
+struct PixelStats {
+    uint64_t histogram[4][256];
+    uint64_t sum[4];
+    uint8_t min[4];
+    uint8_t max[4];
+    uint64_t pixels;
+};
+
 struct Png {
     uint32_t width;
     uint32_t height;
@@ -46,8 +125,26 @@ struct Png {
     png_structp png_ptr;
     png_infop info_ptr;
     png_bytep* row_pointers;
+    png_bytep pixels;
     int color_type;
     int bit_depth;
+    int channels;
+    int input_format;
+    struct InputMap source;
+    struct Arena* arena;
+    struct Arena* scratch;      // память libpng и zlib: сбрасывается, когда декодер закрыт
+
+    // Диапазон изменённых строк
+    int dirty;
+    int dirty_top;
+    int dirty_bottom;
+
+    // Ограничения ресурсов (0 — без ограничения)
+    uint64_t max_pixels;
+    uint64_t mem_budget;
+    int streaming;              // кадр не помещается в бюджет, обработка полосами строк
+    int band_top;               // при потоковой обработке в памяти только строки
+    int band_rows;              // [band_top, band_top + band_rows)
 
     char input_file[MAX_FILENAME_LENGTH];
     char output_file[MAX_FILENAME_LENGTH];
@@ -79,27 +176,110 @@ struct Png {
     int dest_left, dest_top;
     int copy_mode;
 
+    // Заливка области
+    int flood_mode;
+    int flood_x, flood_y;
+    int flood_tolerance;
+    struct Color flood_color;
+
+    // Размытие
+    int blur_mode;
+    int blur_left, blur_top;
+    int blur_right, blur_bottom;
+    int blur_radius;
+
+    // Замена цвета и таблица преобразования
+    int replace_mode;
+    struct Color replace_from;
+    struct Color replace_to;
+    int replace_tolerance;
+    int lut_mode;
+    uint8_t lut[3][256];
+
     int error_code;
 };
 
 // Работа с PNG
 int read_png_file(const char *filename, struct Png *image);
+int read_png_data(const char *name, const png_byte *data, size_t size, struct Png *image);
 int write_png_file(const char *filename, struct Png *image);
+void png_write_outbuf(png_structp png_ptr, png_bytep data, png_size_t length);
+void png_flush_outbuf(png_structp png_ptr);
 void free_image(struct Png *image);
 void process_file(struct Png *image);
+int read_png_stats(const char *filename, struct Png *image, struct PixelStats *stats);
+
+// Ограничения ресурсов и потоковая обработка
+int check_image_limits(struct Png *image, uint64_t frame_bytes, bool can_stream);
+int stream_image_rows(struct Png *image, const char *filename, int format);
+int png_row_reader_open(struct PngRowReader **reader, struct Png *image, const png_byte *data, size_t size);
+int png_row_reader_read(struct PngRowReader *reader, struct Png *image, png_bytep *rows, uint32_t count);
+void png_row_reader_close(struct Png *image);
+
+// Арена
+void arena_init(struct Arena *arena, size_t block_size);
+void *arena_alloc(struct Arena *arena, size_t size);
+void *arena_alloc_aligned(struct Arena *arena, size_t size, size_t align);
+void *arena_calloc(struct Arena *arena, size_t count, size_t size);
+void *arena_malloc(struct Arena *arena, size_t size);
+void *arena_realloc(struct Arena *arena, void *ptr, size_t size);
+void arena_free(struct Arena *arena, void *ptr);
+void arena_reset(struct Arena *arena);
+void arena_release(struct Arena *arena);
+png_voidp png_arena_malloc(png_structp png_ptr, png_alloc_size_t size);
+void png_arena_free(png_structp png_ptr, png_voidp ptr);
+
+// Ввод-вывод ("-" означает stdin/stdout)
+int map_input(const char *filename, struct InputMap *map, struct Arena *arena);
+void unmap_input(struct InputMap *map);
+int outbuf_open(struct OutBuf *out, const char *filename, struct Arena *arena);
+void outbuf_write(struct OutBuf *out, const void *data, size_t size);
+void outbuf_flush(struct OutBuf *out);
+int outbuf_close(struct OutBuf *out);
+bool same_file(const char *input_file, const char *output_file);
+int copy_input_file(const struct InputMap *source, const char *input_file, const char *output_file,
+                    struct Arena *arena);
+
+// Другие форматы
+int detect_format(const png_byte* header, size_t size);
+int parse_format(const char* name);
+const char* format_name(int format);
+int read_image_file(const char *filename, struct Png *image);
+int read_image_data(const char *name, const png_byte *data, size_t size, struct Png *image);
+int write_image_file(const char *filename, struct Png *image, int format);
+int row_writer_open(struct RowWriter **writer, const char *filename, struct Png *image, int format);
+int row_writer_write(struct RowWriter *writer, const png_byte *row);
+int row_writer_close(struct RowWriter *writer, const char *filename);
+int row_reader_open(struct RowReader **reader, struct Png *image, const png_byte *data, size_t size);
+int row_reader_read(struct RowReader *reader, png_bytep *rows, uint32_t count);
+void row_reader_close(struct RowReader *reader);
+
+// Кэш сжатых полос для повторного кодирования
+int write_png_cached(const char *filename, struct Png *image, const char *cache_file);
 
 // Рисование
 void draw_rectangle(struct Png* image, int x0, int y0, int x1, int y1, int thickness, int* color, bool fill, int* fill_color);
 void draw_hexagon(struct Png* image, int x0, int y0, float r, float thickness, int* color, bool fill, int* fill_color);
-void draw_line1(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, int* color, bool fill, int* fill_color);
-void draw_line2(struct Png* image, int x0, int y0, int x1, int y1, float thickness, int* color);
-void draw_line3(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, int* color, bool fill, int* fill_color);
-void plot_circle(struct Png* image, int xm, int ym, int thickness, int* color);
+void draw_line1(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, const png_byte* color, bool fill, const png_byte* fill_color);
+void draw_line2(struct Png* image, int x0, int y0, int x1, int y1, float thickness, const png_byte* color);
+void draw_line3(struct Png* image, int x0, int y0, int x1, int y1, float r, float thickness, const png_byte* color, bool fill, const png_byte* fill_color);
+void plot_circle(struct Png* image, int xm, int ym, int thickness, const png_byte* color);
 void set_pixel(struct Png* image, int x, int y, int* color);
-void fill_part(struct Png* image, int x, int x0, int x1, int y, bool fill, int* fill_color);
+void fill_part(struct Png* image, int x, int x0, int x1, int y, bool fill, const png_byte* fill_color);
 
 // Копирование
 void copy_region(struct Png* image, int src_left, int src_top, int src_right, int src_bottom,
     int dest_left, int dest_top);
 
+// Заливка
+void flood_fill(struct Png* image, int x, int y, int tolerance, int* color);
+
+// Размытие
+void blur_region(struct Png* image, int left, int top, int right, int bottom, int radius, int mode);
+
+// Перекраска
+void replace_color(struct Png* image, int* from, int* to, int tolerance);
+void apply_lut(struct Png* image, uint8_t lut[3][256]);
+int load_lut(const char* filename, uint8_t lut[3][256]);
+
 #endif
\ No newline at end of file